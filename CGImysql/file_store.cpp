@@ -0,0 +1,416 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "file_store.h"
+
+static const char LOG_MAGIC[8] = {'U', 'S', 'E', 'R', 'L', 'O', 'G', '\0'};
+static const char INDEX_MAGIC[8] = {'U', 'S', 'E', 'R', 'I', 'D', 'X', '\0'};
+static const uint32_t FILE_STORE_VERSION = 1;
+static const uint32_t RECORD_MAGIC = 0x55535231; // "USR1"
+
+file_store::file_store(int close_log)
+{
+    m_log_fd = -1;
+    m_log_map = NULL;
+    m_log_end = 0;
+    m_records = 0;
+    m_index_fd = -1;
+    m_index = NULL;
+    m_slots = NULL;
+    m_close_log = close_log;
+}
+
+file_store::~file_store()
+{
+    if (m_index)
+    {
+        // 索引和日志一致，先把槽刷盘再标记为干净，下次启动直接使用
+        m_index->log_end = m_log_end;
+        msync(m_index, sizeof(index_header) + m_index->capacity * sizeof(index_slot), MS_SYNC);
+        m_index->clean = 1;
+        msync(m_index, sizeof(index_header), MS_SYNC);
+    }
+    close_index();
+    if (m_log_map)
+        munmap(m_log_map, FILE_STORE_LOG_MAX);
+    if (m_log_fd >= 0)
+        close(m_log_fd);
+}
+
+// FNV-1a，用作索引的哈希和记录的校验和
+uint64_t file_store::hash(const char *data, size_t len, uint64_t seed)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+size_t file_store::record_size(size_t name_len, size_t passwd_len)
+{
+    return (sizeof(log_record) + name_len + 1 + passwd_len + 1 + 7) & ~(size_t)7;
+}
+
+const char *file_store::record_passwd(uint64_t off)
+{
+    const log_record *rec = (const log_record *)(m_log_map + off);
+    return record_name(off) + rec->name_len + 1;
+}
+
+uint64_t file_store::check_record(uint64_t off, uint64_t end)
+{
+    if (off + sizeof(log_record) > end)
+        return 0;
+    const log_record *rec = (const log_record *)(m_log_map + off);
+    if (rec->magic != RECORD_MAGIC)
+        return 0;
+    uint64_t next = off + record_size(rec->name_len, rec->passwd_len);
+    if (next > end)
+        return 0;
+    const char *name = record_name(off);
+    const char *passwd = name + rec->name_len + 1;
+    if (name[rec->name_len] != '\0' || passwd[rec->passwd_len] != '\0')
+        return 0;
+    if (hash(name, rec->name_len + 1 + rec->passwd_len, rec->name_len) != rec->checksum)
+        return 0;
+    return next;
+}
+
+bool file_store::open(const char *log_path, const char *index_path)
+{
+    m_index_path = index_path;
+    m_log_fd = ::open(log_path, O_RDWR | O_CREAT, 0644);
+    if (m_log_fd < 0)
+    {
+        LOG_ERROR("open %s failed: %s", log_path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(m_log_fd, &st) < 0)
+    {
+        LOG_ERROR("stat %s failed: %s", log_path, strerror(errno));
+        return false;
+    }
+    uint64_t size = st.st_size;
+    if (size < sizeof(log_header))
+    {
+        // 新建日志，头只写了一半也当作新建
+        log_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+        header.version = FILE_STORE_VERSION;
+        if (ftruncate(m_log_fd, 0) < 0 || pwrite(m_log_fd, &header, sizeof(header), 0) != sizeof(header) || fsync(m_log_fd) < 0)
+        {
+            LOG_ERROR("init %s failed: %s", log_path, strerror(errno));
+            return false;
+        }
+        size = sizeof(header);
+    }
+
+    // 一次预留足够大的映射，之后追加的内容经页缓存直接可见
+    void *map = mmap(NULL, FILE_STORE_LOG_MAX, PROT_READ, MAP_SHARED, m_log_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        LOG_ERROR("mmap %s failed: %s", log_path, strerror(errno));
+        return false;
+    }
+    m_log_map = (char *)map;
+    const log_header *header = (const log_header *)m_log_map;
+    if (memcmp(header->magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 || header->version != FILE_STORE_VERSION)
+    {
+        LOG_ERROR("%s is not a user log", log_path);
+        return false;
+    }
+
+    // 找到最后一条完整的记录，之后的内容是崩溃时写了一半的批次
+    uint64_t off = sizeof(log_header), next;
+    while ((next = check_record(off, size)))
+    {
+        off = next;
+        ++m_records;
+    }
+    if (off < size)
+    {
+        LOG_WARN("user log %s has %llu broken bytes at the end, truncated", log_path, (unsigned long long)(size - off));
+        if (ftruncate(m_log_fd, off) < 0)
+        {
+            LOG_ERROR("truncate %s failed: %s", log_path, strerror(errno));
+            return false;
+        }
+    }
+    m_log_end = off;
+
+    if (!open_index())
+    {
+        uint64_t capacity = FILE_STORE_INDEX_MIN;
+        while (capacity < m_records * 2)
+            capacity <<= 1;
+        if (!rebuild_index(capacity))
+            return false;
+        LOG_INFO("user index %s rebuilt from log", index_path);
+    }
+    // 运行期间磁盘上的索引可能和日志不一致，先标记为不干净，崩溃后下次启动会从日志重建
+    m_index->clean = 0;
+    msync(m_index, sizeof(index_header), MS_SYNC);
+
+    LOG_INFO("user store %s: %llu users, %llu bytes, index %llu slots", log_path,
+             (unsigned long long)m_records, (unsigned long long)m_log_end, (unsigned long long)m_index->capacity);
+    return true;
+}
+
+bool file_store::open_index()
+{
+    int fd = ::open(m_index_path.c_str(), O_RDWR);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(index_header))
+    {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    // 上次没有正常关闭，或者和日志对不上，都要重建
+    index_header *header = (index_header *)map;
+    uint64_t capacity = header->capacity;
+    bool ok = memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && header->version == FILE_STORE_VERSION &&
+              header->clean == 1 && capacity >= FILE_STORE_INDEX_MIN && (capacity & (capacity - 1)) == 0 &&
+              (uint64_t)st.st_size == sizeof(index_header) + capacity * sizeof(index_slot) &&
+              header->log_end == m_log_end && header->count == m_records;
+    if (!ok)
+    {
+        LOG_WARN("user index %s is stale", m_index_path.c_str());
+        munmap(map, st.st_size);
+        close(fd);
+        return false;
+    }
+
+    m_index_fd = fd;
+    m_index = header;
+    m_slots = (index_slot *)(header + 1);
+    return true;
+}
+
+void file_store::close_index()
+{
+    if (m_index)
+        munmap(m_index, sizeof(index_header) + m_index->capacity * sizeof(index_slot));
+    if (m_index_fd >= 0)
+        close(m_index_fd);
+    m_index = NULL;
+    m_slots = NULL;
+    m_index_fd = -1;
+}
+
+// 在临时文件里建好新索引再改名替换，只收录m_log_end之前的记录
+bool file_store::rebuild_index(uint64_t capacity)
+{
+    string tmp = m_index_path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        LOG_ERROR("open %s failed: %s", tmp.c_str(), strerror(errno));
+        return false;
+    }
+    size_t size = sizeof(index_header) + capacity * sizeof(index_slot);
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        LOG_ERROR("create %s failed: %s", tmp.c_str(), strerror(errno));
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    // 新文件全是0，clean也是0
+    index_header *header = (index_header *)map;
+    index_slot *slots = (index_slot *)(header + 1);
+    memcpy(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header->version = FILE_STORE_VERSION;
+    header->capacity = capacity;
+    for (uint64_t off = sizeof(log_header); off < m_log_end;)
+    {
+        const log_record *rec = (const log_record *)(m_log_map + off);
+        uint64_t h = hash(record_name(off), rec->name_len, 0);
+        uint64_t pos = h & (capacity - 1);
+        while (slots[pos].offset)
+            pos = (pos + 1) & (capacity - 1);
+        slots[pos].hash = h;
+        slots[pos].offset = off;
+        ++header->count;
+        off += record_size(rec->name_len, rec->passwd_len);
+    }
+    header->log_end = m_log_end;
+
+    if (rename(tmp.c_str(), m_index_path.c_str()) < 0)
+    {
+        LOG_ERROR("rename %s failed: %s", tmp.c_str(), strerror(errno));
+        munmap(map, size);
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    close_index();
+    m_index_fd = fd;
+    m_index = header;
+    m_slots = slots;
+    return true;
+}
+
+uint64_t file_store::find(const char *name, uint64_t h)
+{
+    uint64_t mask = m_index->capacity - 1;
+    for (uint64_t pos = h & mask; m_slots[pos].offset; pos = (pos + 1) & mask)
+    {
+        if (m_slots[pos].hash == h && strcmp(record_name(m_slots[pos].offset), name) == 0)
+            return m_slots[pos].offset;
+    }
+    return 0;
+}
+
+bool file_store::index_put(uint64_t h, uint64_t off)
+{
+    // 装载率不超过一半，线性探测的链很短；扩容失败时只要还有空槽就继续用
+    if ((m_index->count + 1) * 2 > m_index->capacity && !rebuild_index(m_index->capacity * 2) &&
+        m_index->count + 1 >= m_index->capacity)
+        return false;
+
+    uint64_t mask = m_index->capacity - 1;
+    uint64_t pos = h & mask;
+    while (m_slots[pos].offset)
+        pos = (pos + 1) & mask;
+    m_slots[pos].hash = h;
+    m_slots[pos].offset = off;
+    ++m_index->count;
+    return true;
+}
+
+int file_store::query(const char *name, string &passwd)
+{
+    if (!m_index)
+        return -1;
+    uint64_t h = hash(name, strlen(name), 0);
+    m_lock.rdlock();
+    uint64_t off = find(name, h);
+    if (off)
+        passwd = record_passwd(off);
+    m_lock.unlock();
+    return off ? 1 : 0;
+}
+
+// 一批注册拼成一次写入、做一次fdatasync，落盘后才更新索引，查询看不到没有落盘的用户
+int file_store::insert(const char *const *names, const char *const *passwds, int n, bool *ok)
+{
+    if (!m_index)
+        return -1;
+
+    vector<char> buf;
+    vector<uint64_t> hashes;
+    vector<uint64_t> offsets; // 每条记录在buf中的偏移
+    vector<int> rows;         // 每条记录对应的行
+    m_write.lock();
+    for (int i = 0; i < n; ++i)
+    {
+        ok[i] = false;
+        size_t name_len = strlen(names[i]);
+        size_t passwd_len = strlen(passwds[i]);
+        if (name_len == 0 || name_len > 0xffff || passwd_len > 0xffff)
+            continue;
+        uint64_t h = hash(names[i], name_len, 0);
+        if (find(names[i], h))
+            continue;
+        bool dup = false;
+        for (size_t j = 0; j < rows.size() && !dup; ++j)
+            dup = hashes[j] == h && strcmp(names[rows[j]], names[i]) == 0;
+        if (dup)
+            continue;
+
+        size_t off = buf.size();
+        buf.resize(off + record_size(name_len, passwd_len), 0);
+        log_record *rec = (log_record *)&buf[off];
+        rec->magic = RECORD_MAGIC;
+        rec->name_len = name_len;
+        rec->passwd_len = passwd_len;
+        char *name = (char *)(rec + 1);
+        memcpy(name, names[i], name_len + 1);
+        memcpy(name + name_len + 1, passwds[i], passwd_len + 1);
+        rec->checksum = hash(name, name_len + 1 + passwd_len, name_len);
+
+        hashes.push_back(h);
+        offsets.push_back(off);
+        rows.push_back(i);
+    }
+    if (rows.empty())
+    {
+        m_write.unlock();
+        return 0;
+    }
+
+    if (m_log_end + buf.size() > FILE_STORE_LOG_MAX)
+    {
+        LOG_ERROR("%s", "user log is full");
+        m_write.unlock();
+        return -1;
+    }
+    if (pwrite(m_log_fd, buf.data(), buf.size(), m_log_end) != (ssize_t)buf.size() || fdatasync(m_log_fd) < 0)
+    {
+        LOG_ERROR("append user log failed: %s", strerror(errno));
+        // 去掉可能写了一半的批次，截断也失败的话下次启动会截掉
+        if (ftruncate(m_log_fd, m_log_end) < 0)
+            LOG_ERROR("truncate user log failed: %s", strerror(errno));
+        m_write.unlock();
+        return -1;
+    }
+
+    m_lock.wrlock();
+    uint64_t base = m_log_end;
+    for (size_t k = 0; k < rows.size(); ++k)
+    {
+        // 逐条推进m_log_end，扩容重建索引时只收录已经加入索引的记录
+        ok[rows[k]] = index_put(hashes[k], base + offsets[k]);
+        if (!ok[rows[k]])
+            LOG_ERROR("user index is full, %s not indexed until restart", names[rows[k]]);
+        m_log_end = base + (k + 1 < rows.size() ? offsets[k + 1] : buf.size());
+        ++m_records;
+    }
+    m_lock.unlock();
+    m_write.unlock();
+    return 0;
+}
+
+int file_store::scan(unsigned long long after, scan_func fn, void *arg)
+{
+    if (!m_index)
+        return -1;
+
+    m_lock.rdlock();
+    // after是上次读到的最后一条记录的偏移，是合法的记录时从它的下一条开始，否则从头读
+    uint64_t off = sizeof(log_header);
+    if (after >= off && after < m_log_end)
+    {
+        uint64_t next = check_record(after, m_log_end);
+        if (next)
+            off = next;
+    }
+    while (off < m_log_end)
+    {
+        const log_record *rec = (const log_record *)(m_log_map + off);
+        fn(arg, off, record_name(off), record_passwd(off));
+        off += record_size(rec->name_len, rec->passwd_len);
+    }
+    m_lock.unlock();
+    return 1;
+}
@@ -0,0 +1,97 @@
+#ifndef FILE_STORE_H
+#define FILE_STORE_H
+
+#include <stdint.h>
+#include "user_store.h"
+#include "../lock/locker.h"
+
+const uint64_t FILE_STORE_LOG_MAX = 1ULL << 36; // 日志最大64GB，只占虚拟地址空间
+const uint64_t FILE_STORE_INDEX_MIN = 1 << 16;  // 索引最少的槽数
+
+// 嵌入式的用户表：只追加的日志文件保存用户，磁盘上的开放寻址哈希索引按用户名定位日志中的记录，两者都mmap到内存
+// 查询只是在页缓存里探测哈希表，注册追加日志，一批注册只做一次fdatasync
+// 索引只在正常退出时落盘并标记为干净，崩溃后启动时从日志重建索引，日志末尾写了一半的记录被截掉
+class file_store : public user_store
+{
+public:
+    file_store(int close_log);
+    ~file_store();
+
+    // 打开（不存在则创建）日志和索引文件，失败时所有访问都返回-1
+    bool open(const char *log_path, const char *index_path);
+
+    int query(const char *name, string &passwd);
+    int insert(const char *const *names, const char *const *passwds, int n, bool *ok);
+    // 记录在日志中的偏移就是它的id，偏移随追加递增
+    int scan(unsigned long long after, scan_func fn, void *arg);
+    const char *name() { return "file"; }
+
+private:
+    // 日志文件头
+    struct log_header
+    {
+        char magic[8]; // "USERLOG\0"
+        uint32_t version;
+        uint32_t reserved;
+    };
+    // 日志中的一条记录，后面紧跟以'\0'结尾的用户名和密码，整条按8字节对齐
+    struct log_record
+    {
+        uint32_t magic;
+        uint16_t name_len;
+        uint16_t passwd_len;
+        uint64_t checksum; // 用户名和密码的校验和
+    };
+    // 索引文件头，后面紧跟capacity个槽
+    struct index_header
+    {
+        char magic[8]; // "USERIDX\0"
+        uint32_t version;
+        uint32_t clean;    // 正常关闭时为1，打开后立即清零
+        uint64_t capacity; // 槽数，2的幂
+        uint64_t count;    // 已用槽数
+        uint64_t log_end;  // 索引覆盖到的日志长度
+        char reserved[24];
+    };
+    // 索引槽，offset为0表示空槽
+    struct index_slot
+    {
+        uint64_t hash;
+        uint64_t offset;
+    };
+
+    static uint64_t hash(const char *data, size_t len, uint64_t seed);
+    static size_t record_size(size_t name_len, size_t passwd_len);
+
+    // 校验偏移off处的记录，合法时返回下一条记录的偏移，否则返回0
+    uint64_t check_record(uint64_t off, uint64_t end);
+    const char *record_name(uint64_t off) { return m_log_map + off + sizeof(log_record); }
+    const char *record_passwd(uint64_t off);
+
+    // 在索引中查找用户名，找到返回记录偏移，否则返回0
+    uint64_t find(const char *name, uint64_t h);
+    // 把一条记录加入索引，装载率超过一半时先扩容
+    bool index_put(uint64_t h, uint64_t off);
+    // 按给定容量新建索引文件并从日志重建，替换掉当前索引
+    bool rebuild_index(uint64_t capacity);
+    bool open_index();
+    void close_index();
+
+private:
+    int m_log_fd;
+    char *m_log_map;     // 日志的只读映射，一次预留FILE_STORE_LOG_MAX大小，追加时不用重新映射
+    uint64_t m_log_end;  // 日志中已提交记录的末尾
+    uint64_t m_records;  // 日志中的记录数
+
+    string m_index_path;
+    int m_index_fd;
+    index_header *m_index;  // 索引文件的读写映射
+    index_slot *m_slots;
+
+    rwlocker m_lock; // 查询持读锁，修改索引持写锁
+    locker m_write;  // 串行化追加，持有它时读索引不用再加锁
+
+public:
+    int m_close_log; // 日志开关
+};
+#endif
@@ -0,0 +1,136 @@
+#include <sys/time.h>
+#include <set>
+#include "register_batch.h"
+
+register_batch::register_batch()
+{
+    m_store = nullptr;
+    m_window_us = 0;
+    m_max_batch = 1;
+    m_leader = false;
+    m_close_log = 0;
+}
+
+register_batch::~register_batch()
+{
+}
+
+register_batch *register_batch::GetInstance()
+{
+    static register_batch batch;
+    return &batch;
+}
+
+void register_batch::init(user_store *store, int window_us, int max_batch, int close_log)
+{
+    m_store = store;
+    m_window_us = window_us;
+    m_max_batch = max_batch;
+    if (m_max_batch < 1)
+        m_max_batch = 1;
+    if (m_max_batch > SQL_BATCH_MAX)
+        m_max_batch = SQL_BATCH_MAX;
+    m_close_log = close_log;
+}
+
+int register_batch::submit(const char *name, const char *passwd)
+{
+    request req;
+    req.name = name;
+    req.passwd = passwd;
+    req.done = false;
+    req.ok = 0;
+
+    m_lock.lock();
+    m_pending.push_back(&req);
+    // 攒满一批就叫醒leader提前执行
+    if (m_leader && (int)m_pending.size() >= m_max_batch)
+        m_cond.broadcast();
+
+    // 没有leader时自己当leader，否则等自己所在批次执行完
+    while (!req.done)
+    {
+        if (!m_leader)
+        {
+            lead();
+            continue;
+        }
+        m_cond.wait(m_lock.get());
+    }
+    m_lock.unlock();
+    return req.ok;
+}
+
+// 调用前后都持有m_lock，执行插入期间释放锁，新到的注册由下一个leader攒批
+void register_batch::lead()
+{
+    m_leader = true;
+
+    // 在时间窗口内等待其他注册加入
+    if (m_window_us > 0 && (int)m_pending.size() < m_max_batch)
+    {
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        struct timespec t;
+        long long usec = now.tv_usec + m_window_us;
+        t.tv_sec = now.tv_sec + usec / 1000000;
+        t.tv_nsec = (usec % 1000000) * 1000;
+        while ((int)m_pending.size() < m_max_batch)
+        {
+            if (!m_cond.timewait(m_lock.get(), t))
+                break;
+        }
+    }
+
+    // 按到达顺序取走最早的一批
+    vector<request *> batch;
+    if ((int)m_pending.size() <= m_max_batch)
+    {
+        batch.swap(m_pending);
+    }
+    else
+    {
+        batch.assign(m_pending.begin(), m_pending.begin() + m_max_batch);
+        m_pending.erase(m_pending.begin(), m_pending.begin() + m_max_batch);
+    }
+    m_leader = false;
+    m_lock.unlock();
+
+    commit(batch);
+
+    // 通知这一批的线程结果已出，剩下的注册中会有线程醒来接任leader
+    m_lock.lock();
+    for (size_t i = 0; i < batch.size(); ++i)
+        batch[i]->done = true;
+    m_cond.broadcast();
+}
+
+// 去掉同一批里重复的用户名后一次插入
+void register_batch::commit(vector<request *> &batch)
+{
+    // 同一批里重复的用户名只保留第一个，后面的直接判失败
+    vector<request *> rows;
+    set<string> seen;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        if (seen.insert(batch[i]->name).second)
+            rows.push_back(batch[i]);
+        else
+            batch[i]->ok = 0;
+    }
+
+    const char *names[SQL_BATCH_MAX];
+    const char *passwds[SQL_BATCH_MAX];
+    bool ok[SQL_BATCH_MAX];
+    int n = rows.size();
+    for (int i = 0; i < n; ++i)
+    {
+        names[i] = rows[i]->name.c_str();
+        passwds[i] = rows[i]->passwd.c_str();
+    }
+
+    // 整批失败时由存储后端逐行重试，确定每一行的结果
+    int ret = m_store->insert(names, passwds, n, ok);
+    for (int i = 0; i < n; ++i)
+        rows[i]->ok = ret < 0 ? -1 : (ok[i] ? 1 : 0);
+}
@@ -0,0 +1,55 @@
+#ifndef REGISTER_BATCH_H
+#define REGISTER_BATCH_H
+
+#include <vector>
+#include <string>
+#include "user_store.h"
+#include "../lock/locker.h"
+
+using namespace std;
+
+// 注册请求的组提交：一小段时间窗口内到达的注册合并成一条多行INSERT执行
+// 第一个到达的线程成为leader，等待窗口结束或攒满一批后执行插入，其余线程等待自己所在批次的结果
+class register_batch
+{
+public:
+    // 单例模式
+    static register_batch *GetInstance();
+
+    // window_us为攒批的时间窗口，max_batch为一批最多的行数
+    void init(user_store *store, int window_us, int max_batch, int close_log);
+
+    // 提交一个注册，阻塞到所在批次执行完，插入成功返回1，插入失败返回0，拿不到数据库连接返回-1
+    int submit(const char *name, const char *passwd);
+
+private:
+    register_batch();
+    ~register_batch();
+
+    // 一个待插入的用户
+    struct request
+    {
+        string name;
+        string passwd;
+        bool done; // 所在批次是否已执行完
+        int ok;    // 插入结果，同submit的返回值
+    };
+
+    // 当leader：攒批、取走一批并执行
+    void lead();
+    // 执行一批插入，不持有m_lock
+    void commit(vector<request *> &batch);
+
+private:
+    user_store *m_store;
+    int m_window_us;             // 攒批时间窗口
+    int m_max_batch;             // 一批最多的行数
+    locker m_lock;               // 保护m_pending和m_leader
+    cond m_cond;                 // 攒满一批、批次执行完时通知
+    vector<request *> m_pending; // 等待下一批执行的注册
+    bool m_leader;               // 当前是否有leader在攒批
+
+public:
+    int m_close_log; // 日志开关
+};
+#endif
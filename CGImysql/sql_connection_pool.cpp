@@ -1,20 +1,66 @@
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
 #include <stdio.h>
+#include <time.h>
 #include <string>
 #include <string.h>
 #include <stdlib.h>
 #include <list>
+#include <vector>
 #include <pthread.h>
+#include <sys/time.h>
 #include <iostream>
 #include "sql_connection_pool.h"
 
 using namespace std;
 
+// 线程独占的数据库连接，线程退出时关闭
+struct local_conn
+{
+    MYSQL *conn;
+    sql_stmt stmt;     // 连接上的预编译语句，只有本线程使用
+    bool in_use;       // 是否已被本线程取走，嵌套取连接时改用共享池
+    time_t last_used;  // 上次归还的时间，空闲久了用前先ping
+    time_t retry_at;   // 连接失败后，到这个时间之前直接用共享池
+
+    local_conn()
+    {
+        conn = nullptr;
+        memset(&stmt, 0, sizeof(stmt));
+        in_use = false;
+        last_used = 0;
+        retry_at = 0;
+    }
+    ~local_conn()
+    {
+        if (conn)
+        {
+            connection_pool::CloseStmt(stmt);
+            mysql_close(conn);
+        }
+        // 释放客户端库为本线程分配的资源
+        mysql_thread_end();
+    }
+};
+
+static thread_local local_conn t_local;
+
 // 构造函数
 connection_pool::connection_pool()
 {
+    m_MinConn = 0;
+    m_MaxConn = 0;
     m_CurConn = 0;
     m_FreeConn = 0;
+    m_Opening = 0;
+    m_timeout_ms = 0;
+    m_retry_at = 0;
+    m_local = 0;
+    m_acquires = 0;
+    m_wait_us = 0;
+    m_max_wait_us = 0;
+    m_timeouts = 0;
+    m_reconnects = 0;
 }
 
 // 单例模式,程序运行期间只会存在一个数据库对象
@@ -25,7 +71,7 @@ connection_pool *connection_pool::GetInstance()
 }
 
 // 初始化数据库连接池
-void connection_pool::init(string url, string User, string PassWord, string DBName, int Port, int MaxConn, int close_log)
+void connection_pool::init(string url, string User, string PassWord, string DBName, int Port, int MinConn, int MaxConn, int timeout_ms, int local, int close_log)
 {
     // 初始化数据库连接池信息
     m_url = url;
@@ -33,61 +79,239 @@ void connection_pool::init(string url, string User, string PassWord, string DBNa
     m_User = User;
     m_PassWord = PassWord;
     m_DatabaseName = DBName;
+    m_MaxConn = MaxConn > 0 ? MaxConn : 1;
+    m_MinConn = MinConn < m_MaxConn ? MinConn : m_MaxConn;
+    m_timeout_ms = timeout_ms;
+    m_local = local;
     m_close_log = close_log;
 
-    // 创建MaxConn条数据库连接
-    for (int i = 0; i < MaxConn; i++)
+    // 客户端库的全局初始化不是线程安全的，要在多个线程同时mysql_init之前做
+    mysql_library_init(0, nullptr, nullptr);
+
+    // 最少连接数的连接并行建立，启动时间取决于最慢的一条而不是所有连接之和
+    vector<pthread_t> threads(m_MinConn);
+    int started = 0;
+    for (int i = 0; i < m_MinConn; i++)
     {
-        MYSQL *con = nullptr;
-        // 使用mysql_init初始化连接
-        con = mysql_init(con);
+        if (pthread_create(&threads[started], NULL, open_worker, this) == 0)
+            ++started;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
 
-        if (con == nullptr)
-        {
-            LOG_ERROR("MYSQL Error");
-            exit(1);
-        }
+    // 一条都没连上也不退出，数据库相关请求返回503，之后按需重试建连
+    if (m_FreeConn < m_MinConn)
+    {
+        LOG_ERROR("mysql pool opened %d of %d connections", m_FreeConn, m_MinConn);
+    }
+    else
+    {
+        LOG_INFO("mysql pool opened %d connections, max %d", m_FreeConn, m_MaxConn);
+    }
+}
+
+void *connection_pool::open_worker(void *arg)
+{
+    connection_pool *pool = (connection_pool *)arg;
+    mysql_thread_init();
+    MYSQL *con = pool->Open();
+    if (con)
+    {
+        pool->lock.lock();
+        pool->connList.push_back(make_pair(con, time(nullptr)));
+        ++pool->m_FreeConn;
+        pool->lock.unlock();
+    }
+    mysql_thread_end();
+    return pool;
+}
 
-        // 使用mysql_real_connect建立到数据库的连接
-        con = mysql_real_connect(con, url.c_str(), User.c_str(), PassWord.c_str(), DBName.c_str(), Port, nullptr, 0);
+// 建立一条连接，失败返回nullptr
+MYSQL *connection_pool::Connect(bool nonblock)
+{
+    // 使用mysql_init初始化连接
+    MYSQL *con = mysql_init(nullptr);
+    if (con == nullptr)
+    {
+        LOG_ERROR("%s", "mysql_init error");
+        return nullptr;
+    }
 
-        if (con == nullptr)
-        {
-            LOG_ERROR("MYSQL Error");
-            exit(1);
-        }
-        // 更新连接池和空闲连接数量
-        connList.push_back(con);
-        ++m_FreeConn;
+#ifdef MYSQL_WAIT_READ
+    // mariadb的非阻塞查询接口需要在建立连接前开启，阻塞接口照常可用
+    if (nonblock)
+        mysql_options(con, MYSQL_OPT_NONBLOCK, 0);
+#endif
+
+    // 数据库不可达或连接半开时，建连、ping和查询都不能一直阻塞到TCP超时，按取连接的等待时间设超时（秒，向上取整）
+    if (m_timeout_ms > 0)
+    {
+        unsigned int timeout = (m_timeout_ms + 999) / 1000;
+        mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+        mysql_options(con, MYSQL_OPT_READ_TIMEOUT, &timeout);
+        mysql_options(con, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
     }
 
-    // 将信号量初始化为最大连接数
-    reserve = sem(m_FreeConn);
-    m_MaxConn = m_FreeConn;
+    // 使用mysql_real_connect建立到数据库的连接
+    if (!mysql_real_connect(con, m_url.c_str(), m_User.c_str(), m_PassWord.c_str(), m_DatabaseName.c_str(), m_Port, nullptr, 0))
+    {
+        LOG_ERROR("mysql connect error:%s", mysql_error(con));
+        mysql_close(con);
+        return nullptr;
+    }
+    return con;
 }
-// 当有需要时，返回一个数据库连接，同时更新空闲和使用的连接数以及连接池
-MYSQL *connection_pool::GetConnection()
+
+// 建立共享池的连接并预编译语句
+MYSQL *connection_pool::Open()
 {
-    MYSQL *con = nullptr;
+    MYSQL *con = Connect(true);
+    if (!con)
+        return nullptr;
+    sql_stmt stmt;
+    PrepareStmt(con, stmt);
+    m_stmt_lock.wrlock();
+    m_stmts[con] = stmt;
+    m_stmt_lock.unlock();
+    return con;
+}
 
-    if (0 == connList.size())
+// 关闭共享池的连接，调用者需已把它从空闲链表和计数中去掉
+void connection_pool::Close(MYSQL *con)
+{
+    m_stmt_lock.wrlock();
+    map<MYSQL *, sql_stmt>::iterator it = m_stmts.find(con);
+    if (it != m_stmts.end())
     {
-        return nullptr;
+        CloseStmt(it->second);
+        m_stmts.erase(it);
     }
+    m_stmt_lock.unlock();
+    mysql_close(con);
+}
+
+// 是否已经过了deadline
+static bool past(const struct timespec &deadline)
+{
+    struct timeval cur;
+    gettimeofday(&cur, NULL);
+    return cur.tv_sec > deadline.tv_sec || (cur.tv_sec == deadline.tv_sec && cur.tv_usec * 1000 >= deadline.tv_nsec);
+}
 
-    // 操作信号量，如果为0则需要等待变为非0值,wait操作给信号量减一
-    reserve.wait();
+// 当有需要时，返回一个数据库连接，同时更新空闲和使用的连接数以及连接池
+// 没有空闲连接时，连接数未到上限就新建一条，否则等待归还；超过m_timeout_ms仍拿不到返回nullptr
+MYSQL *connection_pool::GetConnection()
+{
+    MYSQL *con = nullptr;
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    struct timespec deadline;
+    long long usec = start.tv_usec + (long long)m_timeout_ms * 1000;
+    deadline.tv_sec = start.tv_sec + usec / 1000000;
+    deadline.tv_nsec = (usec % 1000000) * 1000;
 
     // 防止操作同一个连接， 加锁
     lock.lock();
+    while (true)
+    {
+        if (!connList.empty())
+        {
+            // 后进先出，常用的连接一直热着，空闲久的连接才需要ping
+            pair<MYSQL *, time_t> idle = connList.front();
+            connList.pop_front();
+            --m_FreeConn;
+            ++m_CurConn;
+            if (time(nullptr) - idle.second < SQL_PING_IDLE)
+            {
+                con = idle.first;
+                break;
+            }
 
-    con = connList.front();
-    connList.pop_front();
+            // 服务器可能已经按wait_timeout断开了空闲连接，ping不通就关掉，接着找下一条或新建
+            lock.unlock();
+            bool alive = mysql_ping(idle.first) == 0;
+            if (!alive)
+            {
+                LOG_WARN("mysql connection lost:%s", mysql_error(idle.first));
+                Close(idle.first);
+            }
+            lock.lock();
+            if (alive)
+            {
+                con = idle.first;
+                break;
+            }
+            --m_CurConn;
+            ++m_reconnects;
+            // ping不通可能已经等了一个读超时，过了等待时间就不再试下一条
+            if (m_timeout_ms > 0 && past(deadline))
+            {
+                ++m_timeouts;
+                break;
+            }
+            continue;
+        }
 
-    --m_FreeConn;
-    ++m_CurConn;
+        // 连接数未到上限，新建一条；建连失败后隔一段时间再试，期间只等别人归还
+        time_t now = time(nullptr);
+        if (m_CurConn + m_FreeConn + m_Opening < m_MaxConn && now >= m_retry_at)
+        {
+            ++m_Opening;
+            lock.unlock();
+            MYSQL *fresh = Open();
+            lock.lock();
+            --m_Opening;
+            if (fresh)
+            {
+                ++m_CurConn;
+                con = fresh;
+                break;
+            }
+            m_retry_at = time(nullptr) + SQL_RETRY_INTERVAL;
+            // 建连失败可能已经等了一个连接超时，过了等待时间直接返回
+            if (m_timeout_ms > 0 && past(deadline))
+            {
+                ++m_timeouts;
+                break;
+            }
+            continue;
+        }
 
+        // 等待归还，等到重试建连的时间也醒来看看
+        struct timespec t = deadline;
+        bool retry = m_CurConn + m_FreeConn + m_Opening < m_MaxConn;
+        if (retry && (m_timeout_ms <= 0 || m_retry_at < deadline.tv_sec))
+        {
+            t.tv_sec = m_retry_at;
+            t.tv_nsec = 0;
+        }
+        if (m_timeout_ms <= 0 && !retry)
+        {
+            m_cond.wait(lock.get());
+            continue;
+        }
+        m_cond.timewait(lock.get(), t);
+
+        if (m_timeout_ms > 0 && connList.empty() && past(deadline))
+        {
+            ++m_timeouts;
+            break;
+        }
+    }
+
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    long long wait_us = (end.tv_sec - start.tv_sec) * 1000000LL + end.tv_usec - start.tv_usec;
+    ++m_acquires;
+    m_wait_us += wait_us;
+    if (wait_us > m_max_wait_us)
+        m_max_wait_us = wait_us;
     lock.unlock();
+
+    if (!con)
+    {
+        LOG_WARN("get mysql connection timeout after %lldus", wait_us);
+    }
     return con;
 }
 
@@ -98,19 +322,260 @@ bool connection_pool::ReleaseConnection(MYSQL *con)
     {
         return false;
     }
-    lock.lock();
 
-    connList.push_back(con);
-    ++m_FreeConn;
+    // 用的过程中连接断了，不再放回池中，之后按需新建
+    unsigned int err = mysql_errno(con);
+    bool lost = err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+    if (lost)
+    {
+        LOG_WARN("mysql connection lost:%s", mysql_error(con));
+        Close(con);
+    }
+
+    lock.lock();
+    if (lost)
+    {
+        ++m_reconnects;
+    }
+    else
+    {
+        connList.push_front(make_pair(con, time(nullptr)));
+        ++m_FreeConn;
+    }
     --m_CurConn;
+    // 连接断开时连接数也少了一条，等待的线程醒来可以新建
+    m_cond.signal();
+    lock.unlock();
+    return true;
+}
 
+// 取出统计，reset为真时清零最大等待时间，按统计周期计算
+void connection_pool::GetStats(sql_pool_stats &stats, bool reset)
+{
+    lock.lock();
+    stats.in_use = m_CurConn;
+    stats.idle = m_FreeConn;
+    stats.max = m_MaxConn;
+    stats.acquires = m_acquires;
+    stats.wait_us = m_wait_us;
+    stats.max_wait_us = m_max_wait_us;
+    stats.timeouts = m_timeouts;
+    stats.reconnects = m_reconnects;
+    if (reset)
+        m_max_wait_us = 0;
     lock.unlock();
+}
+
+// 预编译查询语句，插入语句按批量大小在第一次用到时再预编译
+void connection_pool::PrepareStmt(MYSQL *con, sql_stmt &stmt)
+{
+    memset(&stmt, 0, sizeof(stmt));
+    stmt.query_user = mysql_stmt_init(con);
+    const char *query = "SELECT passwd FROM user WHERE username = ?";
+    if (stmt.query_user && mysql_stmt_prepare(stmt.query_user, query, strlen(query)))
+    {
+        LOG_ERROR("prepare error:%s", mysql_stmt_error(stmt.query_user));
+        mysql_stmt_close(stmt.query_user);
+        stmt.query_user = nullptr;
+    }
+}
+
+void connection_pool::CloseStmt(sql_stmt &stmt)
+{
+    if (stmt.query_user)
+        mysql_stmt_close(stmt.query_user);
+    for (int i = 0; i < SQL_BATCH_MAX; ++i)
+    {
+        if (stmt.insert_user[i])
+            mysql_stmt_close(stmt.insert_user[i]);
+    }
+    memset(&stmt, 0, sizeof(stmt));
+}
+
+// 取本线程独占的连接，没开启、连不上或已被本线程占用时退回共享池
+MYSQL *connection_pool::GetLocalConnection()
+{
+    if (!m_local || t_local.in_use)
+        return GetConnection();
+
+    time_t now = time(nullptr);
+    // 空闲久了先ping一下，服务器可能已经按wait_timeout断开了连接
+    if (t_local.conn && now - t_local.last_used >= SQL_PING_IDLE && mysql_ping(t_local.conn))
+    {
+        LOG_WARN("local mysql connection lost:%s, reconnecting", mysql_error(t_local.conn));
+        DropLocalConnection();
+    }
+
+    if (!t_local.conn)
+    {
+        // 连接失败后隔一段时间再重试，期间用共享池，不让这个线程卡在反复建连上
+        if (now < t_local.retry_at)
+            return GetConnection();
+        // 独占连接只走阻塞接口，不需要开启非阻塞选项
+        MYSQL *con = Connect(false);
+        if (!con)
+        {
+            t_local.retry_at = now + SQL_RETRY_INTERVAL;
+            return GetConnection();
+        }
+        t_local.conn = con;
+        PrepareStmt(con, t_local.stmt);
+    }
+
+    t_local.in_use = true;
+    return t_local.conn;
+}
+
+// 归还连接，不是本线程的独占连接就还给共享池
+bool connection_pool::ReleaseLocalConnection(MYSQL *con)
+{
+    if (con == nullptr || con != t_local.conn)
+        return ReleaseConnection(con);
+
+    t_local.in_use = false;
+    t_local.last_used = time(nullptr);
+    // 用的过程中连接断了，关掉，下次取的时候重连
+    unsigned int err = mysql_errno(con);
+    if (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST)
+    {
+        LOG_WARN("local mysql connection lost:%s", mysql_error(con));
+        DropLocalConnection();
+    }
+    return true;
+}
+
+void connection_pool::DropLocalConnection()
+{
+    CloseStmt(t_local.stmt);
+    mysql_close(t_local.conn);
+    t_local.conn = nullptr;
+}
+
+// 获取连接上预编译的语句，独占连接的语句存在线程局部变量里
+sql_stmt *connection_pool::GetStmt(MYSQL *con)
+{
+    if (con && con == t_local.conn)
+        return &t_local.stmt;
+
+    // map的节点在插入删除其他连接时地址不变，连接归调用者独占，拿到指针后不用一直加锁
+    m_stmt_lock.rdlock();
+    map<MYSQL *, sql_stmt>::iterator it = m_stmts.find(con);
+    sql_stmt *stmt = it == m_stmts.end() ? nullptr : &it->second;
+    m_stmt_lock.unlock();
+    return stmt;
+}
+
+// 插入语句的结构只和行数n有关，每条连接上每种n只预编译一次
+MYSQL_STMT *connection_pool::GetInsertStmt(MYSQL *con, int n)
+{
+    sql_stmt *stmt = GetStmt(con);
+    if (!stmt || n <= 0 || n > SQL_BATCH_MAX)
+        return nullptr;
+
+    MYSQL_STMT *&insert = stmt->insert_user[n - 1];
+    if (!insert)
+    {
+        // INSERT INTO user(username, passwd) VALUES(?, ?),(?, ?)...
+        string sql = "INSERT INTO user(username, passwd) VALUES(?, ?)";
+        for (int i = 1; i < n; ++i)
+            sql += ",(?, ?)";
+        insert = mysql_stmt_init(con);
+        if (!insert)
+            return nullptr;
+        if (mysql_stmt_prepare(insert, sql.c_str(), sql.size()))
+        {
+            LOG_ERROR("prepare error:%s", mysql_stmt_error(insert));
+            mysql_stmt_close(insert);
+            insert = nullptr;
+        }
+    }
+    return insert;
+}
+
+// 一条语句插入n个用户
+bool connection_pool::InsertUsers(MYSQL *con, const char *const *names, const char *const *passwds, int n)
+{
+    MYSQL_STMT *insert = GetInsertStmt(con, n);
+    if (!insert)
+        return false;
+
+    // 参数只绑定指针和长度，不拷贝数据，也不需要转义
+    MYSQL_BIND bind[2 * SQL_BATCH_MAX];
+    unsigned long lens[2 * SQL_BATCH_MAX];
+    memset(bind, 0, sizeof(bind));
+    for (int i = 0; i < n; ++i)
+    {
+        lens[2 * i] = strlen(names[i]);
+        bind[2 * i].buffer_type = MYSQL_TYPE_STRING;
+        bind[2 * i].buffer = (void *)names[i];
+        bind[2 * i].buffer_length = lens[2 * i];
+        bind[2 * i].length = &lens[2 * i];
 
-    // 释放连接信号量原子加一
-    reserve.post();
+        lens[2 * i + 1] = strlen(passwds[i]);
+        bind[2 * i + 1].buffer_type = MYSQL_TYPE_STRING;
+        bind[2 * i + 1].buffer = (void *)passwds[i];
+        bind[2 * i + 1].buffer_length = lens[2 * i + 1];
+        bind[2 * i + 1].length = &lens[2 * i + 1];
+    }
+
+    if (mysql_stmt_bind_param(insert, bind) || mysql_stmt_execute(insert))
+    {
+        LOG_ERROR("INSERT error:%s", mysql_stmt_error(insert));
+        return false;
+    }
     return true;
 }
 
+// 按用户名查询密码
+int connection_pool::QueryPasswd(MYSQL *con, const char *name, string &passwd)
+{
+    sql_stmt *stmt = GetStmt(con);
+    if (!stmt || !stmt->query_user)
+        return -1;
+    MYSQL_STMT *query = stmt->query_user;
+
+    MYSQL_BIND param;
+    unsigned long name_len = strlen(name);
+    memset(&param, 0, sizeof(param));
+    param.buffer_type = MYSQL_TYPE_STRING;
+    param.buffer = (void *)name;
+    param.buffer_length = name_len;
+    param.length = &name_len;
+
+    MYSQL_BIND result;
+    char buf[SQL_FIELD_LEN];
+    unsigned long buf_len = 0;
+    memset(&result, 0, sizeof(result));
+    result.buffer_type = MYSQL_TYPE_STRING;
+    result.buffer = buf;
+    result.buffer_length = sizeof(buf);
+    result.length = &buf_len;
+
+    if (mysql_stmt_bind_param(query, &param) || mysql_stmt_bind_result(query, &result) ||
+        mysql_stmt_execute(query) || mysql_stmt_store_result(query))
+    {
+        LOG_ERROR("SELECT error:%s", mysql_stmt_error(query));
+        mysql_stmt_reset(query);
+        return -1;
+    }
+
+    int ret = 0;
+    int status = mysql_stmt_fetch(query);
+    if (status == 0 || status == MYSQL_DATA_TRUNCATED)
+    {
+        if (buf_len > sizeof(buf))
+            buf_len = sizeof(buf);
+        passwd.assign(buf, buf_len);
+        ret = 1;
+    }
+    else if (status != MYSQL_NO_DATA)
+    {
+        ret = -1;
+    }
+    mysql_stmt_free_result(query);
+    return ret;
+}
+
 // 获取空闲连接数
 int connection_pool::GetFreeConn()
 {
@@ -124,15 +589,12 @@ void connection_pool::DestroyPool()
     if(connList.size() > 0)
     {
         //迭代器遍历，关闭数据库连接
-        list<MYSQL*>::iterator it;
+        list<pair<MYSQL*, time_t> >::iterator it;
         for(it = connList.begin(); it != connList.end(); ++it)
         {
-            MYSQL* con = *it;
-
-            //使用mysql_close关闭连接
-            mysql_close(con);
+            //先关闭连接上预编译的语句，再使用mysql_close关闭连接
+            Close(it->first);
         }
-        m_CurConn = 0;
         m_FreeConn = 0;
         connList.clear();
     }
@@ -147,15 +609,19 @@ connection_pool::~connection_pool()
 
 //RAII
 //在构造时获取连接
-connectionRAII::connectionRAII(MYSQL **SQL, connection_pool* connPool)
+connectionRAII::connectionRAII(MYSQL **SQL, connection_pool* connPool, bool local)
 {
-    *SQL = connPool->GetConnection();
+    *SQL = local ? connPool->GetLocalConnection() : connPool->GetConnection();
 
     conRAII = *SQL;
     poolRAII = connPool;
+    localRAII = local;
 }
 //在析构时释放连接
 connectionRAII::~connectionRAII()
 {
-    poolRAII->ReleaseConnection(conRAII);
+    if (localRAII)
+        poolRAII->ReleaseLocalConnection(conRAII);
+    else
+        poolRAII->ReleaseConnection(conRAII);
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 #include <list>
+#include <map>
+#include <time.h>
 #include <mysql/mysql.h>
 #include <error.h>
 #include <string.h>
@@ -13,33 +15,105 @@
 
 using namespace std;
 
+const int SQL_BATCH_MAX = 16;    // 一条批量插入语句最多插入的行数
+const int SQL_FIELD_LEN = 100;   // 用户名、密码的最大长度
+const int SQL_PING_IDLE = 30;       // 连接空闲超过这么多秒，用前先ping
+const int SQL_RETRY_INTERVAL = 1;   // 建连失败后，隔这么多秒再重试
+
+// 每条连接上预编译的语句，同一条连接同一时刻只会被一个线程使用，所以语句也不需要加锁
+struct sql_stmt
+{
+    MYSQL_STMT *query_user;                 // 按用户名查密码
+    MYSQL_STMT *insert_user[SQL_BATCH_MAX]; // 插入i+1行的语句，第一次用到时才预编译
+};
+
+// 连接池的统计
+struct sql_pool_stats
+{
+    int in_use;             // 正在使用的连接数
+    int idle;               // 空闲连接数
+    int max;                // 最大连接数
+    long long acquires;     // 取连接的次数
+    long long wait_us;      // 取连接的总等待时间
+    long long max_wait_us;  // 上次清零以来最长的一次等待
+    long long timeouts;     // 等待超时的次数
+    long long reconnects;   // 发现连接断开而关闭的次数
+};
+
 class connection_pool
 {
 public:
-    MYSQL *GetConnection();              // 获取数据库连接
+    MYSQL *GetConnection();              // 获取数据库连接，超时返回nullptr
     bool ReleaseConnection(MYSQL *conn); // 释放连接
     int GetFreeConn();                   // 获取空闲连接数
     void DestroyPool();                  // 销毁所有连接
 
+    // 获取本线程独占的连接，用时不加锁；未开启或不可用时从共享池取
+    MYSQL *GetLocalConnection();
+    // 归还GetLocalConnection取到的连接
+    bool ReleaseLocalConnection(MYSQL *conn);
+
+    // 预编译连接上的查询语句
+    void PrepareStmt(MYSQL *conn, sql_stmt &stmt);
+    // 关闭连接上所有预编译的语句
+    static void CloseStmt(sql_stmt &stmt);
+    // 获取连接上预编译的语句
+    sql_stmt *GetStmt(MYSQL *conn);
+    // 获取连接上插入n行的预编译语句，第一次用到时预编译
+    MYSQL_STMT *GetInsertStmt(MYSQL *conn, int n);
+    // 用预编译语句一次插入n个用户，成功返回true
+    bool InsertUsers(MYSQL *conn, const char *const *names, const char *const *passwds, int n);
+    // 用预编译语句查询用户密码，找到返回1，不存在返回0，出错返回-1
+    int QueryPasswd(MYSQL *conn, const char *name, string &passwd);
+
     // 单例模式,程序运行期间只会存在一个数据库对象
     static connection_pool *GetInstance();
 
     // 初始化数据库
-    void init(string url, string User, string PassWord, string DataBaseName, int Port, int MaxConn, int close_log);
+    // 取出统计，reset为真时清零最大等待时间
+    void GetStats(sql_pool_stats &stats, bool reset);
+
+    // 启动时并行建立MinConn条连接，之后按需增长到MaxConn条；取连接最多等timeout_ms毫秒，不大于0表示一直等
+    // local为1时每个工作线程独占一条连接，共享池只在线程独占连接不可用或嵌套使用时兜底
+    void init(string url, string User, string PassWord, string DataBaseName, int Port, int MinConn, int MaxConn, int timeout_ms, int local, int close_log);
 
 private:
     connection_pool();      //构造、析构放在私有里，保证只有一个对象
     ~connection_pool();
+    // 关闭本线程独占的连接，下次取时重连
+    void DropLocalConnection();
+    // 建立一条连接，nonblock为真时开启mariadb的非阻塞接口
+    MYSQL *Connect(bool nonblock);
+    // 建立共享池的连接并预编译语句
+    MYSQL *Open();
+    // 关闭共享池的连接和它的预编译语句
+    void Close(MYSQL *conn);
+    // 启动时并行建连的线程函数
+    static void *open_worker(void *arg);
+
+    int m_MinConn;          // 最少连接数，启动时建立
     int m_MaxConn;          // 最大连接数
     int m_CurConn;          // 当前已使用的连接数
     int m_FreeConn;         // 空闲的连接数
+    int m_Opening;          // 正在新建的连接数
+    int m_timeout_ms;       // 取连接的最长等待时间
+    time_t m_retry_at;      // 建连失败后，到这个时间之前不再新建
     locker lock;            // 互斥锁
-    list<MYSQL *> connList; // 连接池
-    sem reserve;            // 信号量
+    cond m_cond;            // 有连接归还时通知等待的线程
+    list<pair<MYSQL *, time_t> > connList; // 空闲连接和它的归还时间，后进先出
+    rwlocker m_stmt_lock;   // 保护m_stmts，连接按需新建、断开时关闭
+    map<MYSQL *, sql_stmt> m_stmts; // 共享池每条连接的预编译语句
+    int m_local;            // 是否开启线程独占连接
+
+    long long m_acquires;   // 下面是统计，由lock保护
+    long long m_wait_us;
+    long long m_max_wait_us;
+    long long m_timeouts;
+    long long m_reconnects;
 
 public:
     string m_url;          // 主机地址
-    string m_Port;         // 端口号
+    int m_Port;            // 端口号
     string m_User;         // 数据库登陆用户名
     string m_PassWord;     // 数据库密码
     string m_DatabaseName; // 使用的数据库名
@@ -51,10 +125,12 @@ class connectionRAII
 public:
     //数据库连接本身是一个指针，所以这里想要在内部修改它的话，要传入二级指针才能修改
     //通过有参构造，在构造函数内对参数（这里是数据库连接）进行修改
-    connectionRAII(MYSQL** con, connection_pool* connPool);
+    //local为true时优先用本线程独占的连接，只在请求处理路径上使用
+    connectionRAII(MYSQL** con, connection_pool* connPool, bool local = false);
     ~connectionRAII();
 private:
     MYSQL* conRAII;
     connection_pool* poolRAII;
+    bool localRAII;
 };
 #endif
\ No newline at end of file
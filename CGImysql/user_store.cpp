@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "user_store.h"
+
+mysql_store::mysql_store(connection_pool *connPool, int close_log)
+{
+    m_connPool = connPool;
+    m_close_log = close_log;
+    m_has_id = -1;
+}
+
+int mysql_store::query(const char *name, string &passwd)
+{
+    // 只在查询期间占用一条数据库连接，开启线程独占连接时用本线程的连接，不用加锁
+    MYSQL *mysql = nullptr;
+    connectionRAII mysqlcon(&mysql, m_connPool, true);
+    if (!mysql)
+        return -1;
+    return m_connPool->QueryPasswd(mysql, name, passwd);
+}
+
+// 先整批插入，失败（如某个用户名已存在）再在同一条连接上逐行插入，确定每一行的结果
+int mysql_store::insert(const char *const *names, const char *const *passwds, int n, bool *ok)
+{
+    MYSQL *mysql = nullptr;
+    connectionRAII mysqlcon(&mysql, m_connPool, true);
+    if (!mysql)
+        return -1;
+
+    bool all = m_connPool->InsertUsers(mysql, names, passwds, n);
+    for (int i = 0; i < n; ++i)
+        ok[i] = all;
+    if (all || n == 1)
+        return 0;
+
+    LOG_WARN("batch insert of %d users failed, retry one by one", n);
+    for (int i = 0; i < n; ++i)
+        ok[i] = m_connPool->InsertUsers(mysql, &names[i], &passwds[i], 1);
+    return 0;
+}
+
+// 表结构运行期间不会变，查一次information_schema后缓存结果
+bool mysql_store::has_id(MYSQL *mysql)
+{
+    int cached = __atomic_load_n(&m_has_id, __ATOMIC_RELAXED);
+    if (cached != -1)
+        return cached == 1;
+
+    int found = 0;
+    if (mysql_query(mysql, "SELECT COUNT(*) FROM information_schema.COLUMNS "
+                           "WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = 'user' AND COLUMN_NAME = 'id'"))
+    {
+        // 查不了information_schema时按没有id列处理，全量读取总是可行的
+        LOG_INFO("check id column of user table failed:%s, read the whole table", mysql_error(mysql));
+    }
+    else if (MYSQL_RES *result = mysql_store_result(mysql))
+    {
+        MYSQL_ROW row = mysql_fetch_row(result);
+        found = row && row[0] && atoi(row[0]) > 0;
+        mysql_free_result(result);
+        if (!found)
+            LOG_INFO("user table has no id column, read the whole table");
+    }
+    __atomic_store_n(&m_has_id, found, __ATOMIC_RELAXED);
+    return found;
+}
+
+int mysql_store::scan(unsigned long long after, scan_func fn, void *arg)
+{
+    MYSQL *mysql = nullptr;
+    connectionRAII mysqlcon(&mysql, m_connPool);
+    if (!mysql)
+        return -1;
+
+    int ret = 1;
+    if (has_id(mysql))
+    {
+        // 提交顺序和id顺序不一致时，比after小但提交晚的行会漏掉，项目里的注册是单行或一批一条语句，可以忽略
+        char sql[128];
+        snprintf(sql, sizeof(sql), "SELECT id, username, passwd FROM user WHERE id > %llu", after);
+        if (mysql_query(mysql, sql))
+        {
+            LOG_ERROR("SELECT error:%s", mysql_error(mysql));
+            return -1;
+        }
+    }
+    else
+    {
+        // 表里没有自增id列，只能全量读取
+        if (after > 0)
+            return -1;
+        if (mysql_query(mysql, "SELECT 0, username, passwd FROM user"))
+        {
+            LOG_ERROR("SELECT error:%s", mysql_error(mysql));
+            return -1;
+        }
+        ret = 0;
+    }
+
+    // 逐行从服务器取结果，不把整个结果集先放到客户端内存里
+    MYSQL_RES *result = mysql_use_result(mysql);
+    if (!result)
+        return -1;
+    while (MYSQL_ROW row = mysql_fetch_row(result))
+    {
+        fn(arg, strtoull(row[0], NULL, 10), row[1], row[2]);
+    }
+    if (mysql_errno(mysql))
+    {
+        LOG_ERROR("fetch user error:%s", mysql_error(mysql));
+        ret = -1;
+    }
+    mysql_free_result(result);
+    return ret;
+}
+
+memory_store::memory_store(int latency_us, int close_log)
+{
+    m_latency_us = latency_us;
+    m_close_log = close_log;
+}
+
+void memory_store::delay()
+{
+    if (m_latency_us > 0)
+        usleep(m_latency_us);
+}
+
+int memory_store::query(const char *name, string &passwd)
+{
+    delay();
+    int ret = 0;
+    m_lock.rdlock();
+    unordered_map<string, string>::iterator it = m_users.find(name);
+    if (it != m_users.end())
+    {
+        passwd = it->second;
+        ret = 1;
+    }
+    m_lock.unlock();
+    return ret;
+}
+
+// 一批只算一次往返，和MySQL的多行插入一致；用户名重复的行插入失败
+int memory_store::insert(const char *const *names, const char *const *passwds, int n, bool *ok)
+{
+    delay();
+    m_lock.wrlock();
+    for (int i = 0; i < n; ++i)
+    {
+        ok[i] = m_users.insert(make_pair(string(names[i]), string(passwds[i]))).second;
+        if (ok[i])
+            m_names.push_back(names[i]);
+    }
+    m_lock.unlock();
+    return 0;
+}
+
+int memory_store::scan(unsigned long long after, scan_func fn, void *arg)
+{
+    delay();
+    m_lock.rdlock();
+    for (size_t i = after; i < m_names.size(); ++i)
+    {
+        const string &name = m_names[i];
+        fn(arg, i + 1, name.c_str(), m_users.find(name)->second.c_str());
+    }
+    m_lock.unlock();
+    return 1;
+}
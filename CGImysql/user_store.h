@@ -0,0 +1,75 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "sql_connection_pool.h"
+#include "../lock/locker.h"
+
+using namespace std;
+
+// 用户表的存储接口，登录注册、快照追读、布隆过滤器建立都只通过它访问用户数据
+// 有两个实现：mysql_store访问MySQL，memory_store是进程内的表，可注入固定延迟，不需要MySQL就能压测
+class user_store
+{
+public:
+    // scan的回调，id为用户的自增id，没有id列时为0
+    typedef void (*scan_func)(void *arg, unsigned long long id, const char *name, const char *passwd);
+
+    virtual ~user_store() {}
+    // 按用户名查询密码，找到返回1，不存在返回0，出错或拿不到连接返回-1
+    virtual int query(const char *name, string &passwd) = 0;
+    // 插入n个用户，ok[i]为每一行是否成功；拿不到连接返回-1，否则返回0
+    virtual int insert(const char *const *names, const char *const *passwds, int n, bool *ok) = 0;
+    // 逐个取出id大于after的用户；按id取成功返回1，表中没有id列时取全部用户并返回0（只在after为0时），出错返回-1
+    virtual int scan(unsigned long long after, scan_func fn, void *arg) = 0;
+    // 存储后端的名字，写日志用
+    virtual const char *name() = 0;
+};
+
+// MySQL后端，查询和插入走预编译语句
+class mysql_store : public user_store
+{
+public:
+    mysql_store(connection_pool *connPool, int close_log);
+    int query(const char *name, string &passwd);
+    int insert(const char *const *names, const char *const *passwds, int n, bool *ok);
+    int scan(unsigned long long after, scan_func fn, void *arg);
+    const char *name() { return "mysql"; }
+
+private:
+    // 用户表有没有自增id列
+    bool has_id(MYSQL *mysql);
+
+private:
+    connection_pool *m_connPool;
+    int m_has_id;   // 用户表有没有id列，-1表示还没检查过
+
+public:
+    int m_close_log; // 日志开关
+};
+
+// 进程内的用户表，每次访问先等latency_us微秒模拟数据库往返，等待期间不持有锁
+class memory_store : public user_store
+{
+public:
+    memory_store(int latency_us, int close_log);
+    int query(const char *name, string &passwd);
+    int insert(const char *const *names, const char *const *passwds, int n, bool *ok);
+    int scan(unsigned long long after, scan_func fn, void *arg);
+    const char *name() { return "memory"; }
+
+private:
+    void delay();
+
+private:
+    int m_latency_us;
+    rwlocker m_lock;
+    unordered_map<string, string> m_users;  // 用户名到密码
+    vector<string> m_names;                 // 按插入顺序的用户名，下标加一就是id
+
+public:
+    int m_close_log; // 日志开关
+};
+#endif
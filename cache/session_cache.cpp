@@ -0,0 +1,151 @@
+#include <string.h>
+#include <sys/random.h>
+#include "session_cache.h"
+#include "../timer/clock_cache.h"
+
+session_cache::session_cache()
+{
+    m_shard_capacity = 0;
+    m_ttl = 0;
+    m_hits = 0;
+    m_misses = 0;
+}
+
+session_cache::~session_cache()
+{
+}
+
+session_cache *session_cache::GetInstance()
+{
+    static session_cache cache;
+    return &cache;
+}
+
+void session_cache::init(size_t capacity, int ttl)
+{
+    m_shard_capacity = capacity / SESSION_SHARDS;
+    if (m_shard_capacity == 0)
+        m_shard_capacity = 1;
+    m_ttl = ttl;
+}
+
+session_cache::shard &session_cache::shard_of(const char *token)
+{
+    static const char hex[] = "0123456789abcdef";
+    int hi = strchr(hex, token[0]) - hex;
+    int lo = strchr(hex, token[1]) - hex;
+    return m_shards[(hi * 16 + lo) & (SESSION_SHARDS - 1)];
+}
+
+void session_cache::evict(shard &s, time_t now, size_t capacity)
+{
+    while (!s.order.empty())
+    {
+        unordered_map<string, session>::iterator it = s.sessions.find(s.order.front());
+        if (it != s.sessions.end())
+        {
+            if (it->second.expire > now && (capacity == 0 || s.sessions.size() < capacity))
+                break;
+            s.sessions.erase(it);
+        }
+        s.order.pop_front();
+    }
+}
+
+void session_cache::compact(shard &s)
+{
+    deque<string> order;
+    for (size_t i = 0; i < s.order.size(); ++i)
+    {
+        if (s.sessions.count(s.order[i]))
+            order.push_back(s.order[i]);
+    }
+    s.order.swap(order);
+}
+
+bool session_cache::create(const char *name, char *token)
+{
+    unsigned char bytes[SESSION_TOKEN_LEN / 2];
+    if (getrandom(bytes, sizeof(bytes), 0) != (ssize_t)sizeof(bytes))
+        return false;
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < sizeof(bytes); ++i)
+    {
+        token[i * 2] = hex[bytes[i] >> 4];
+        token[i * 2 + 1] = hex[bytes[i] & 15];
+    }
+    token[SESSION_TOKEN_LEN] = '\0';
+
+    time_t now = clock_cache::now();
+    session item;
+    item.name = name;
+    item.expire = now + m_ttl;
+    shard &s = shard_of(token);
+    s.lock.lock();
+    // 先腾出位置，分片满了淘汰最早创建的会话
+    evict(s, now, m_shard_capacity);
+    s.sessions[token] = item;
+    s.order.push_back(token);
+    s.lock.unlock();
+    return true;
+}
+
+bool session_cache::lookup(const char *token, string *name)
+{
+    if (strlen(token) != SESSION_TOKEN_LEN || strspn(token, "0123456789abcdef") != SESSION_TOKEN_LEN)
+    {
+        __atomic_fetch_add(&m_misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    bool found = false;
+    shard &s = shard_of(token);
+    s.lock.lock();
+    unordered_map<string, session>::iterator it = s.sessions.find(token);
+    // 过期但还没被定时器清理的会话也算不存在
+    if (it != s.sessions.end() && it->second.expire > clock_cache::now())
+    {
+        found = true;
+        if (name)
+            *name = it->second.name;
+    }
+    s.lock.unlock();
+    __atomic_fetch_add(found ? &m_hits : &m_misses, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+void session_cache::remove(const char *token)
+{
+    if (strlen(token) != SESSION_TOKEN_LEN || strspn(token, "0123456789abcdef") != SESSION_TOKEN_LEN)
+        return;
+    shard &s = shard_of(token);
+    s.lock.lock();
+    // 队列里的令牌先留着，淘汰时找不到会话就直接跳过
+    // 分片没满时淘汰停在第一个有效会话，后面的无效令牌会一直积压到过期，超过容量两倍时整理一次
+    if (s.sessions.erase(token) && s.order.size() > 2 * m_shard_capacity)
+        compact(s);
+    s.lock.unlock();
+}
+
+void session_cache::expire()
+{
+    time_t now = clock_cache::now();
+    for (int i = 0; i < SESSION_SHARDS; ++i)
+    {
+        m_shards[i].lock.lock();
+        evict(m_shards[i], now, 0);
+        m_shards[i].lock.unlock();
+    }
+}
+
+size_t session_cache::size()
+{
+    size_t n = 0;
+    for (int i = 0; i < SESSION_SHARDS; ++i)
+    {
+        m_shards[i].lock.lock();
+        n += m_shards[i].sessions.size();
+        m_shards[i].lock.unlock();
+    }
+    return n;
+}
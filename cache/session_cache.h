@@ -0,0 +1,75 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include <time.h>
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include "../lock/locker.h"
+
+using namespace std;
+
+const int SESSION_SHARDS = 16;          // 分片数，必须是2的幂
+const int SESSION_TOKEN_LEN = 32;       // 会话令牌长度，16字节随机数的十六进制
+const char SESSION_COOKIE[] = "sid";    // 会话cookie的名字
+
+// 登录成功后的会话，cookie里的随机令牌到用户名的映射，带令牌的请求查一次哈希表就能确认已登录
+// 按令牌分片，每个分片一把锁；会话有效期固定，分片内按创建顺序排队，过期和超出容量时都从队头淘汰
+// 过期会话由定时器每次到期时清理，查找时也会检查有效期
+class session_cache
+{
+public:
+    // 单例模式
+    static session_cache *GetInstance();
+
+    // capacity为最多保存的会话数，ttl为会话有效秒数
+    void init(size_t capacity, int ttl);
+    // 会话有效秒数，设置cookie的Max-Age用
+    int ttl() { return m_ttl; }
+
+    // 为用户新建会话，token写入令牌（SESSION_TOKEN_LEN个字符加'\0'），取随机数失败返回false
+    bool create(const char *name, char *token);
+    // 令牌对应的会话存在且未过期时返回true，name不为空时取出用户名
+    bool lookup(const char *token, string *name);
+    // 删除令牌对应的会话，重新登录时换掉旧令牌
+    void remove(const char *token);
+    // 清理过期会话，由定时器调用
+    void expire();
+
+    // 会话数，命中与未命中次数
+    size_t size();
+    long long hits() { return __atomic_load_n(&m_hits, __ATOMIC_RELAXED); }
+    long long misses() { return __atomic_load_n(&m_misses, __ATOMIC_RELAXED); }
+
+private:
+    session_cache();
+    ~session_cache();
+
+    struct session
+    {
+        string name;
+        time_t expire;
+    };
+
+    struct shard
+    {
+        locker lock;
+        unordered_map<string, session> sessions;
+        deque<string> order; // 按创建顺序的令牌，也就是按过期时间排序
+    };
+
+    // 令牌是随机数，取前两个字符就能均匀分片
+    shard &shard_of(const char *token);
+    // 从队头淘汰过期的会话，capacity不为0时再淘汰到低于capacity，调用者持有分片的锁
+    void evict(shard &s, time_t now, size_t capacity);
+    // 去掉队列里已经没有会话的令牌，调用者持有分片的锁
+    void compact(shard &s);
+
+private:
+    shard m_shards[SESSION_SHARDS];
+    size_t m_shard_capacity; // 每个分片最多的会话数
+    int m_ttl;
+    long long m_hits;
+    long long m_misses;
+};
+#endif
@@ -0,0 +1,495 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include "user_cache.h"
+
+user_cache::user_cache()
+{
+    m_capacity = 0;
+    m_shard_capacity = 0;
+    m_negative_ttl = 0;
+    m_hits = 0;
+    m_misses = 0;
+    m_snap_base = nullptr;
+    m_snap_size = 0;
+    m_snap_entries = nullptr;
+    m_snap_count = 0;
+    m_snap_strings = nullptr;
+    m_snap_strings_len = 0;
+    for (int i = 0; i < USER_CACHE_SHARDS; ++i)
+    {
+        m_shards[i].slots.resize(USER_CACHE_SHARD_INIT);
+        m_shards[i].count = 0;
+        m_shards[i].hand = 0;
+    }
+}
+
+user_cache::~user_cache()
+{
+    if (m_snap_base)
+        munmap(m_snap_base, m_snap_size);
+}
+
+user_cache *user_cache::GetInstance()
+{
+    static user_cache cache;
+    return &cache;
+}
+
+// 在放入任何数据之前调用
+void user_cache::init(size_t capacity, int negative_ttl)
+{
+    m_capacity = capacity;
+    m_negative_ttl = negative_ttl;
+    if (m_capacity == 0)
+        return;
+
+    // 限定容量时一次分配好，槽数取不小于容量/0.7的2的幂，之后不再扩容
+    m_shard_capacity = (m_capacity + USER_CACHE_SHARDS - 1) / USER_CACHE_SHARDS;
+    size_t slots = USER_CACHE_SHARD_INIT;
+    while (slots * 7 < m_shard_capacity * 10)
+        slots *= 2;
+    for (int i = 0; i < USER_CACHE_SHARDS; ++i)
+    {
+        m_shards[i].lock.wrlock();
+        m_shards[i].slots.clear();
+        m_shards[i].slots.resize(slots);
+        m_shards[i].count = 0;
+        m_shards[i].hand = 0;
+        m_shards[i].lock.unlock();
+    }
+}
+
+// FNV-1a，高位决定分片，低位决定槽位
+uint64_t user_cache::hash(const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    // 再混一次，让高位也充分依赖每个字节
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return h ? h : 1;
+}
+
+long user_cache::find(shard &s, uint64_t h, const char *name)
+{
+    size_t mask = s.slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask)
+    {
+        slot &sl = s.slots[i];
+        if (sl.hash == 0)
+            return -1;
+        if (sl.hash == h && sl.name == name)
+            return i;
+    }
+}
+
+void user_cache::grow(shard &s)
+{
+    vector<slot> old;
+    old.swap(s.slots);
+    s.slots.resize(old.size() * 2);
+    size_t mask = s.slots.size() - 1;
+    for (size_t j = 0; j < old.size(); ++j)
+    {
+        if (old[j].hash == 0)
+            continue;
+        size_t i = old[j].hash & mask;
+        while (s.slots[i].hash != 0)
+            i = (i + 1) & mask;
+        s.slots[i].hash = old[j].hash;
+        s.slots[i].name.swap(old[j].name);
+        s.slots[i].passwd.swap(old[j].passwd);
+        s.slots[i].expire = old[j].expire;
+        s.slots[i].ref = old[j].ref;
+    }
+}
+
+void user_cache::erase(shard &s, size_t i)
+{
+    size_t mask = s.slots.size() - 1;
+    size_t j = i;
+    while (true)
+    {
+        j = (j + 1) & mask;
+        if (s.slots[j].hash == 0)
+            break;
+        // 条目理想位置k在(i, j]之间时不能前移，否则会跑到自己的理想位置之前
+        size_t k = s.slots[j].hash & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        s.slots[i].hash = s.slots[j].hash;
+        s.slots[i].name.swap(s.slots[j].name);
+        s.slots[i].passwd.swap(s.slots[j].passwd);
+        s.slots[i].expire = s.slots[j].expire;
+        s.slots[i].ref = s.slots[j].ref;
+        i = j;
+    }
+    s.slots[i].hash = 0;
+    s.slots[i].name.clear();
+    s.slots[i].passwd.clear();
+    --s.count;
+}
+
+void user_cache::evict(shard &s)
+{
+    size_t mask = s.slots.size() - 1;
+    // 最多转两圈：第一圈清掉所有访问位，第二圈一定能找到可淘汰的条目
+    while (s.count > 0)
+    {
+        slot &sl = s.slots[s.hand];
+        if (sl.hash != 0)
+        {
+            if (!sl.ref)
+            {
+                // 删除后会有条目前移到hand，下次从这里继续
+                erase(s, s.hand);
+                return;
+            }
+            sl.ref = 0;
+        }
+        s.hand = (s.hand + 1) & mask;
+    }
+}
+
+USER_LOOKUP user_cache::lookup(const char *name, string &passwd, bool *snapshot)
+{
+    uint64_t h = hash(name);
+    shard &s = shard_of(h);
+    USER_LOOKUP ret = USER_MISS;
+    s.lock.rdlock();
+    long i = find(s, h, name);
+    if (i >= 0)
+    {
+        slot &sl = s.slots[i];
+        if (sl.expire == 0)
+        {
+            passwd = sl.passwd;
+            ret = USER_FOUND;
+        }
+        else if (sl.expire > time(nullptr))
+        {
+            ret = USER_ABSENT;
+        }
+        // 读锁下多个线程可能同时置位，用原子写；已置位就不再写，避免缓存行来回失效
+        if (ret != USER_MISS && !__atomic_load_n(&sl.ref, __ATOMIC_RELAXED))
+            __atomic_store_n(&sl.ref, 1, __ATOMIC_RELAXED);
+    }
+    s.lock.unlock();
+
+    // 哈希表里没有再查快照，快照只读，不用加锁
+    size_t snap_count = __atomic_load_n(&m_snap_count, __ATOMIC_ACQUIRE);
+    bool from_snapshot = false;
+    if (ret == USER_MISS && snap_count > 0)
+    {
+        const char *p = snapshot_find(h, name, snap_count);
+        if (p)
+        {
+            passwd = p;
+            ret = USER_FOUND;
+            from_snapshot = true;
+        }
+    }
+    if (snapshot)
+        *snapshot = from_snapshot;
+
+    if (ret == USER_MISS)
+        __atomic_fetch_add(&m_misses, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&m_hits, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+void user_cache::set(const char *name, const char *passwd, time_t expire)
+{
+    uint64_t h = hash(name);
+    shard &s = shard_of(h);
+    s.lock.wrlock();
+    long i = find(s, h, name);
+    if (i >= 0)
+    {
+        s.slots[i].passwd = passwd;
+        s.slots[i].expire = expire;
+        s.lock.unlock();
+        return;
+    }
+
+    if (m_shard_capacity > 0)
+    {
+        // 限定容量，满了先淘汰
+        if (s.count >= m_shard_capacity)
+            evict(s);
+    }
+    else if ((s.count + 1) * 10 > s.slots.size() * 7)
+    {
+        // 装载因子超过0.7就扩容，保证探测链足够短
+        grow(s);
+    }
+
+    size_t mask = s.slots.size() - 1;
+    size_t j = h & mask;
+    while (s.slots[j].hash != 0)
+        j = (j + 1) & mask;
+    s.slots[j].hash = h;
+    s.slots[j].name = name;
+    s.slots[j].passwd = passwd;
+    s.slots[j].expire = expire;
+    s.slots[j].ref = 0;
+    ++s.count;
+    s.lock.unlock();
+}
+
+void user_cache::put(const char *name, const char *passwd)
+{
+    set(name, passwd, 0);
+}
+
+void user_cache::put_negative(const char *name)
+{
+    if (m_negative_ttl <= 0)
+        return;
+    set(name, "", time(nullptr) + m_negative_ttl);
+}
+
+size_t user_cache::size()
+{
+    size_t n = 0;
+    for (int i = 0; i < USER_CACHE_SHARDS; ++i)
+    {
+        m_shards[i].lock.rdlock();
+        n += m_shards[i].count;
+        m_shards[i].lock.unlock();
+    }
+    return n + __atomic_load_n(&m_snap_count, __ATOMIC_RELAXED);
+}
+
+const char *user_cache::snapshot_find(uint64_t h, const char *name, size_t count)
+{
+    const snapshot_entry *end = m_snap_entries + count;
+    const snapshot_entry *e = lower_bound(m_snap_entries, end, h,
+                                          [](const snapshot_entry &a, uint64_t h) { return a.hash < h; });
+    // 哈希值相同的条目相邻，逐个比较用户名
+    for (; e != end && e->hash == h; ++e)
+    {
+        if (e->name < m_snap_strings_len && e->passwd < m_snap_strings_len &&
+            strcmp(m_snap_strings + e->name, name) == 0)
+            return m_snap_strings + e->passwd;
+    }
+    return nullptr;
+}
+
+// 按8字节一组做乘法散列，比逐字节快，只用来发现文件损坏
+uint64_t user_cache::checksum(const char *data, size_t len, uint64_t seed)
+{
+    uint64_t h = seed;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 31;
+    }
+    for (; i < len; ++i)
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+bool user_cache::save(const char *path, unsigned long long hwm)
+{
+    // 先按分片取出哈希表里的正常条目，分片由哈希值高位决定，分片内排好序后整体就是有序的
+    vector<snapshot_entry> fresh;
+    string fresh_strings;
+    for (int i = 0; i < USER_CACHE_SHARDS; ++i)
+    {
+        shard &s = m_shards[i];
+        size_t begin = fresh.size();
+        s.lock.rdlock();
+        for (size_t j = 0; j < s.slots.size(); ++j)
+        {
+            slot &sl = s.slots[j];
+            if (sl.hash == 0 || sl.expire != 0)
+                continue;
+            snapshot_entry e;
+            e.hash = sl.hash;
+            e.name = fresh_strings.size();
+            fresh_strings.append(sl.name.c_str(), sl.name.size() + 1);
+            e.passwd = fresh_strings.size();
+            fresh_strings.append(sl.passwd.c_str(), sl.passwd.size() + 1);
+            fresh.push_back(e);
+        }
+        s.lock.unlock();
+        sort(fresh.begin() + begin, fresh.end(),
+             [](const snapshot_entry &a, const snapshot_entry &b) { return a.hash < b.hash; });
+    }
+
+    // 和已加载的快照归并，同名条目以哈希表为准
+    vector<snapshot_entry> entries;
+    string strings;
+    size_t snap_count = __atomic_load_n(&m_snap_count, __ATOMIC_ACQUIRE);
+    entries.reserve(fresh.size() + snap_count);
+    strings.reserve(fresh_strings.size() + m_snap_strings_len);
+    size_t a = 0, b = 0;
+    while (a < fresh.size() || b < snap_count)
+    {
+        const char *src;
+        snapshot_entry e;
+        if (b == snap_count || (a < fresh.size() && fresh[a].hash <= m_snap_entries[b].hash))
+        {
+            e = fresh[a++];
+            src = fresh_strings.data();
+        }
+        else
+        {
+            e = m_snap_entries[b++];
+            src = m_snap_strings;
+            if (e.name >= m_snap_strings_len || e.passwd >= m_snap_strings_len)
+                continue;
+            // 哈希值相同的新条目已经写过，再看是不是同一个用户
+            bool dup = false;
+            for (size_t k = entries.size(); k > 0 && entries[k - 1].hash == e.hash; --k)
+            {
+                if (strcmp(strings.c_str() + entries[k - 1].name, src + e.name) == 0)
+                    dup = true;
+            }
+            if (dup)
+                continue;
+        }
+        const char *name = src + e.name;
+        const char *passwd = src + e.passwd;
+        e.name = strings.size();
+        strings.append(name, strlen(name) + 1);
+        e.passwd = strings.size();
+        strings.append(passwd, strlen(passwd) + 1);
+        entries.push_back(e);
+    }
+    if (strings.size() > UINT32_MAX)
+        return false;
+
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "USERSNAP", 8);
+    header.version = USER_SNAPSHOT_VERSION;
+    header.shards = USER_CACHE_SHARDS;
+    header.count = entries.size();
+    header.hwm = hwm;
+    header.strings_len = strings.size();
+    header.checksum = checksum((const char *)entries.data(), entries.size() * sizeof(snapshot_entry), header.count);
+    header.checksum = checksum(strings.data(), strings.size(), header.checksum);
+
+    string tmp = string(path) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return false;
+
+    struct iovec iv[3];
+    iv[0].iov_base = &header;
+    iv[0].iov_len = sizeof(header);
+    iv[1].iov_base = entries.data();
+    iv[1].iov_len = entries.size() * sizeof(snapshot_entry);
+    iv[2].iov_base = (void *)strings.data();
+    iv[2].iov_len = strings.size();
+    size_t total = iv[0].iov_len + iv[1].iov_len + iv[2].iov_len;
+
+    // writev可能只写了一部分，循环写完
+    size_t written = 0;
+    int idx = 0;
+    while (written < total)
+    {
+        ssize_t n = writev(fd, iv + idx, 3 - idx);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        written += n;
+        while (idx < 3 && (size_t)n >= iv[idx].iov_len)
+        {
+            n -= iv[idx].iov_len;
+            ++idx;
+        }
+        if (idx < 3)
+        {
+            iv[idx].iov_base = (char *)iv[idx].iov_base + n;
+            iv[idx].iov_len -= n;
+        }
+    }
+
+    bool ok = written == total && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path) != 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool user_cache::load(const char *path, unsigned long long &hwm)
+{
+    if (m_snap_base)
+        return false;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_header))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    char *base = (char *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    const snapshot_header *header = (const snapshot_header *)base;
+    const snapshot_entry *entries = (const snapshot_entry *)(base + sizeof(snapshot_header));
+    bool ok = memcmp(header->magic, "USERSNAP", 8) == 0 && header->version == USER_SNAPSHOT_VERSION &&
+              header->shards == USER_CACHE_SHARDS && header->count <= size / sizeof(snapshot_entry) &&
+              sizeof(snapshot_header) + header->count * sizeof(snapshot_entry) + header->strings_len == size;
+    if (ok)
+    {
+        // 校验时顺序读一遍整个文件，顺便把页面读进内存
+        size_t entries_len = header->count * sizeof(snapshot_entry);
+        const char *strings = (const char *)entries + entries_len;
+        uint64_t sum = checksum((const char *)entries, entries_len, header->count);
+        ok = checksum(strings, header->strings_len, sum) == header->checksum;
+        // 字符串区必须以'\0'结尾，否则按偏移取字符串可能读出界
+        if (header->count > 0 && (header->strings_len == 0 || strings[header->strings_len - 1] != '\0'))
+            ok = false;
+    }
+    if (!ok)
+    {
+        munmap(base, size);
+        return false;
+    }
+
+    // 之后是按哈希值的随机查找
+    madvise(base, size, MADV_RANDOM);
+    m_snap_base = base;
+    m_snap_size = size;
+    m_snap_entries = entries;
+    m_snap_strings = (const char *)entries + header->count * sizeof(snapshot_entry);
+    m_snap_strings_len = header->strings_len;
+    __atomic_store_n(&m_snap_count, header->count, __ATOMIC_RELEASE);
+    hwm = header->hwm;
+    return true;
+}
+
+void user_cache::drop_snapshot()
+{
+    __atomic_store_n(&m_snap_count, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,135 @@
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "../lock/locker.h"
+
+using namespace std;
+
+const int USER_CACHE_SHARDS = 64;        // 分片数，必须是2的幂
+const int USER_CACHE_SHARD_INIT = 64;    // 不限容量时每个分片初始槽数，必须是2的幂
+const uint32_t USER_SNAPSHOT_VERSION = 1; // 快照格式版本，快照里存了哈希值，改动哈希函数时也要加一
+
+// lookup的结果
+enum USER_LOOKUP
+{
+    USER_MISS = 0, // 缓存中没有，需要查数据库
+    USER_FOUND,    // 用户存在，密码已取出
+    USER_ABSENT    // 负缓存命中，用户确定不存在
+};
+
+// 用户名到密码的并发哈希表，用于登录校验和注册查重
+// 按哈希值分成多个分片，每个分片一把读写锁，登录查找只加读锁，不同分片之间互不影响
+// 分片内部是线性探测的开放寻址表，槽里存完整哈希值，哈希不等时不用比较字符串
+// 容量为0时不限大小，用于启动时全量加载用户表；容量大于0时按CLOCK算法淘汰，未命中时由调用者查库后回填
+// 可以再挂一个mmap的只读快照作为底层，哈希表未命中时在快照里二分查找，加载快照不用逐条插入
+class user_cache
+{
+public:
+    // 单例模式，所有http连接共享
+    static user_cache *GetInstance();
+
+    // capacity为最多缓存的用户数（含负缓存），0表示不限；negative_ttl为负缓存的有效秒数
+    void init(size_t capacity, int negative_ttl);
+    // 是否限制了容量（按需加载模式）
+    bool bounded() { return m_capacity > 0; }
+
+    // 用户名的64位哈希，不会为0，布隆过滤器也用它
+    static uint64_t hash(const char *name);
+
+    // 查找用户，存在时取出密码；snapshot不为空时记下结果是否来自快照（快照可能已经过时）
+    USER_LOOKUP lookup(const char *name, string &passwd, bool *snapshot = nullptr);
+    // 插入或覆盖
+    void put(const char *name, const char *passwd);
+    // 记录用户不存在
+    void put_negative(const char *name);
+    // 缓存的条目数
+    size_t size();
+    // 命中与未命中次数
+    long long hits() { return __atomic_load_n(&m_hits, __ATOMIC_RELAXED); }
+    long long misses() { return __atomic_load_n(&m_misses, __ATOMIC_RELAXED); }
+
+    // 把快照和哈希表里的正常条目（不含负缓存）合并写入快照文件，hwm为数据库中已经全部进入缓存的最大用户id
+    // 先写临时文件再rename，中途崩溃不会留下半个快照，已经mmap的旧快照也不受影响
+    bool save(const char *path, unsigned long long hwm);
+    // mmap快照文件作为只读底层，成功时通过hwm返回快照的高水位，只能在开始处理请求前调用一次
+    bool load(const char *path, unsigned long long &hwm);
+    // 快照不再参与查找和转储，用于全量模式重新读完用户表之后；映射保留到退出，正在查找的线程不受影响
+    void drop_snapshot();
+
+private:
+    // 快照文件头，后面依次是按哈希值排序的count个snapshot_entry和以'\0'结尾的字符串区
+    struct snapshot_header
+    {
+        char magic[8];          // "USERSNAP"
+        uint32_t version;
+        uint32_t shards;
+        uint64_t count;
+        uint64_t hwm;
+        uint64_t strings_len;
+        uint64_t checksum;      // 条目和字符串区的校验和
+    };
+    struct snapshot_entry
+    {
+        uint64_t hash;
+        uint32_t name;          // 用户名在字符串区的偏移
+        uint32_t passwd;        // 密码在字符串区的偏移
+    };
+
+private:
+    user_cache();
+    ~user_cache();
+
+    // 哈希值0表示空槽，计算出0的改成1
+    struct slot
+    {
+        uint64_t hash;
+        string name;
+        string passwd;
+        time_t expire;  // 负缓存的过期时间，正常条目为0
+        uint8_t ref;    // CLOCK访问位，读锁下原子地置位
+    };
+
+    // 对齐到缓存行，避免相邻分片的锁互相伪共享
+    struct alignas(64) shard
+    {
+        rwlocker lock;
+        vector<slot> slots;
+        size_t count;
+        size_t hand;    // CLOCK指针
+    };
+
+    shard &shard_of(uint64_t h) { return m_shards[h >> 58 & (USER_CACHE_SHARDS - 1)]; }
+    // 在分片中查找，返回槽下标，不存在返回-1，调用前需持有分片的锁
+    static long find(shard &s, uint64_t h, const char *name);
+    // 扩容到两倍，调用前需持有分片的写锁
+    static void grow(shard &s);
+    // 删除槽i，把后面探测链上的条目前移，保证线性探测不断链，调用前需持有分片的写锁
+    static void erase(shard &s, size_t i);
+    // 按CLOCK算法淘汰一个条目，调用前需持有分片的写锁
+    static void evict(shard &s);
+    // 插入或覆盖，expire为0表示正常条目
+    void set(const char *name, const char *passwd, time_t expire);
+    // 在快照的前count个条目中查找，返回密码，不存在返回nullptr
+    const char *snapshot_find(uint64_t h, const char *name, size_t count);
+    static uint64_t checksum(const char *data, size_t len, uint64_t seed);
+
+private:
+    shard m_shards[USER_CACHE_SHARDS];
+    size_t m_capacity;       // 总容量，0表示不限
+    size_t m_shard_capacity; // 每个分片的容量
+    int m_negative_ttl;      // 负缓存有效期
+    long long m_hits;
+    long long m_misses;
+
+    char *m_snap_base;                      // mmap的快照文件，加载后只读
+    size_t m_snap_size;
+    const snapshot_entry *m_snap_entries;
+    size_t m_snap_count;                    // 快照条目数，drop_snapshot后为0
+    const char *m_snap_strings;
+    size_t m_snap_strings_len;
+};
+#endif
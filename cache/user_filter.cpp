@@ -0,0 +1,191 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "user_filter.h"
+
+user_filter::user_filter()
+{
+    memset(m_layers, 0, sizeof(m_layers));
+    m_nlayers = 0;
+    m_fpr = 0;
+    m_enabled = false;
+    m_queries = 0;
+    m_negatives = 0;
+    m_false_positives = 0;
+    m_close_log = 0;
+}
+
+user_filter::~user_filter()
+{
+    for (int i = 0; i < m_nlayers; ++i)
+        free(m_layers[i].bits);
+}
+
+user_filter *user_filter::GetInstance()
+{
+    static user_filter filter;
+    return &filter;
+}
+
+void user_filter::init(size_t capacity, double fpr, int close_log)
+{
+    m_close_log = close_log;
+    m_lock.lock();
+    if (m_nlayers == 0)
+        add_layer(capacity, fpr);
+    m_lock.unlock();
+}
+
+bool user_filter::add_layer(size_t capacity, double fpr)
+{
+    if (m_nlayers >= USER_FILTER_MAX_LAYERS || capacity == 0)
+        return false;
+
+    // 每个元素需要的位数m/n = -ln(p)/(ln2)^2，最优的k = m/n*ln2
+    double bits_per_name = -log(fpr) / (M_LN2 * M_LN2);
+    int k = (int)(bits_per_name * M_LN2 + 0.5);
+    if (k < 1)
+        k = 1;
+    if (k > 16)
+        k = 16;
+    size_t blocks = (size_t)(capacity * bits_per_name / 512) + 1;
+
+    uint64_t *bits = (uint64_t *)aligned_alloc(64, blocks * 64);
+    if (!bits)
+        return false;
+    memset(bits, 0, blocks * 64);
+
+    layer &l = m_layers[m_nlayers];
+    l.bits = bits;
+    l.blocks = blocks;
+    l.k = k;
+    l.capacity = capacity;
+    l.count = 0;
+    l.set_bits = 0;
+    m_fpr = fpr;
+    // 新层初始化完成后再发布，读者看到层数增加时一定能看到完整的层
+    __atomic_store_n(&m_nlayers, m_nlayers + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// 哈希值高32位选块，块内k个位置由哈希值反复做乘加得到，取高9位
+void user_filter::set(layer &l, uint64_t h)
+{
+    uint64_t *block = l.bits + (((h >> 32) * l.blocks) >> 32) * 8;
+    uint64_t x = h;
+    for (int i = 0; i < l.k; ++i)
+    {
+        x = x * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL;
+        unsigned bit = x >> 55;
+        uint64_t mask = 1ULL << (bit & 63);
+        uint64_t old = __atomic_fetch_or(&block[bit >> 6], mask, __ATOMIC_RELAXED);
+        if (!(old & mask))
+            __atomic_fetch_add(&l.set_bits, 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool user_filter::test(const layer &l, uint64_t h)
+{
+    const uint64_t *block = l.bits + (((h >> 32) * l.blocks) >> 32) * 8;
+    uint64_t x = h;
+    for (int i = 0; i < l.k; ++i)
+    {
+        x = x * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL;
+        unsigned bit = x >> 55;
+        if (!(__atomic_load_n(&block[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63))))
+            return false;
+    }
+    return true;
+}
+
+void user_filter::add(const char *name)
+{
+    uint64_t h = user_cache::hash(name);
+    while (true)
+    {
+        int n = __atomic_load_n(&m_nlayers, __ATOMIC_ACQUIRE);
+        if (n == 0)
+            return;
+        layer &l = m_layers[n - 1];
+        // 并发加入时可能略微超过容量，不影响正确性
+        if (__atomic_load_n(&l.count, __ATOMIC_RELAXED) < l.capacity)
+        {
+            __atomic_fetch_add(&l.count, 1, __ATOMIC_RELAXED);
+            set(l, h);
+            return;
+        }
+
+        // 当前层满了，追加一层；别的线程已经追加过就直接重试
+        m_lock.lock();
+        bool grown = __atomic_load_n(&m_nlayers, __ATOMIC_RELAXED) != n || add_layer(l.capacity * 2, m_fpr / 2);
+        m_lock.unlock();
+        if (!grown)
+        {
+            // 层数到上限或内存不足，只能继续往最后一层加，误判率会上升
+            __atomic_fetch_add(&l.count, 1, __ATOMIC_RELAXED);
+            set(l, h);
+            return;
+        }
+    }
+}
+
+bool user_filter::may_contain(const char *name)
+{
+    __atomic_fetch_add(&m_queries, 1, __ATOMIC_RELAXED);
+    uint64_t h = user_cache::hash(name);
+    int n = __atomic_load_n(&m_nlayers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; ++i)
+    {
+        if (test(m_layers[i], h))
+            return true;
+    }
+    __atomic_fetch_add(&m_negatives, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+static void build_row(void *arg, unsigned long long, const char *name, const char *)
+{
+    ((user_filter *)arg)->add(name);
+}
+
+bool user_filter::build(user_store *store)
+{
+    if (layers() == 0)
+        return false;
+    // MySQL后端逐行从服务器取结果，用户表再大客户端也只占一行的内存
+    if (store->scan(0, build_row, this) < 0)
+        return false;
+
+    __atomic_store_n(&m_enabled, true, __ATOMIC_RELEASE);
+    LOG_INFO("user filter built: %zu names, %d layers, %zuKB", count(), layers(), memory() / 1024);
+    return true;
+}
+
+size_t user_filter::count()
+{
+    size_t n = 0;
+    for (int i = 0; i < layers(); ++i)
+        n += __atomic_load_n(&m_layers[i].count, __ATOMIC_RELAXED);
+    return n;
+}
+
+size_t user_filter::memory()
+{
+    size_t n = 0;
+    for (int i = 0; i < layers(); ++i)
+        n += m_layers[i].blocks * 64;
+    return n;
+}
+
+// 单层误判率约为置位比例的k次方，任意一层误判整体就误判
+double user_filter::estimated_fpr()
+{
+    double pass = 1.0;
+    for (int i = 0; i < layers(); ++i)
+    {
+        const layer &l = m_layers[i];
+        double fill = (double)__atomic_load_n(&l.set_bits, __ATOMIC_RELAXED) / (l.blocks * 512);
+        pass *= 1.0 - pow(fill, l.k);
+    }
+    return 1.0 - pass;
+}
@@ -0,0 +1,79 @@
+#ifndef USER_FILTER_H
+#define USER_FILTER_H
+
+#include <stdint.h>
+#include <string>
+#include "user_cache.h"
+#include "../CGImysql/user_store.h"
+#include "../lock/locker.h"
+
+using namespace std;
+
+const int USER_FILTER_MAX_LAYERS = 16; // 最多扩容的层数
+
+// 全部用户名的布隆过滤器，回答“一定不存在”时注册查重和登录都不用再查缓存和数据库
+// 按块组织：一个用户名的k个位都落在同一个64字节的块里，一次查询只碰一条缓存行
+// 置位用原子或，查询不加锁；插入数超过当前层容量时追加一层，新层容量翻倍、误判率减半，总误判率有上界
+// 只能增不能删，项目不会删除用户；只记录本进程看到的注册，多个实例共用一个库时不能开启
+class user_filter
+{
+public:
+    // 单例模式
+    static user_filter *GetInstance();
+
+    // capacity为第一层能容纳的用户名数，fpr为第一层的目标误判率
+    void init(size_t capacity, double fpr, int close_log);
+    // 逐个读取存储中的所有用户名建立过滤器，成功后才启用
+    bool build(user_store *store);
+    // 是否已启用，未启用时调用者当作“可能存在”
+    bool enabled() { return __atomic_load_n(&m_enabled, __ATOMIC_ACQUIRE); }
+
+    // 加入用户名，注册成功后调用
+    void add(const char *name);
+    // 返回false表示一定不存在
+    bool may_contain(const char *name);
+    // 过滤器说可能存在、数据库说不存在时调用，用于统计实际误判
+    void report_false_positive() { __atomic_fetch_add(&m_false_positives, 1, __ATOMIC_RELAXED); }
+
+    // 统计：加入的用户名数、层数、占用字节数、按置位比例估计的误判率
+    size_t count();
+    int layers() { return __atomic_load_n(&m_nlayers, __ATOMIC_ACQUIRE); }
+    size_t memory();
+    double estimated_fpr();
+    long long queries() { return __atomic_load_n(&m_queries, __ATOMIC_RELAXED); }
+    long long negatives() { return __atomic_load_n(&m_negatives, __ATOMIC_RELAXED); }
+    long long false_positives() { return __atomic_load_n(&m_false_positives, __ATOMIC_RELAXED); }
+
+private:
+    user_filter();
+    ~user_filter();
+
+    struct layer
+    {
+        uint64_t *bits;    // blocks个64字节的块
+        size_t blocks;
+        int k;             // 每个用户名置位的个数
+        size_t capacity;   // 超过这个数就追加新层
+        size_t count;      // 已加入的用户名数
+        size_t set_bits;   // 已置位的位数，用来估计误判率
+    };
+
+    // 追加一层，调用前需持有m_lock
+    bool add_layer(size_t capacity, double fpr);
+    static void set(layer &l, uint64_t h);
+    static bool test(const layer &l, uint64_t h);
+
+private:
+    layer m_layers[USER_FILTER_MAX_LAYERS];
+    int m_nlayers;          // 已建立的层数，新层初始化完成后才增加
+    double m_fpr;           // 最后一层的目标误判率
+    locker m_lock;          // 追加新层时加锁
+    bool m_enabled;
+    long long m_queries;
+    long long m_negatives;
+    long long m_false_positives;
+
+public:
+    int m_close_log; // 日志开关
+};
+#endif
@@ -0,0 +1,90 @@
+#include <sys/time.h>
+#include "user_flight.h"
+
+user_flight::user_flight()
+{
+    m_timeout_ms = 0;
+    m_leaders = 0;
+    m_followers = 0;
+}
+
+user_flight::~user_flight()
+{
+}
+
+user_flight *user_flight::GetInstance()
+{
+    static user_flight flight;
+    return &flight;
+}
+
+void user_flight::init(int timeout_ms)
+{
+    m_timeout_ms = timeout_ms;
+}
+
+int user_flight::query(user_store *store, const char *name, string &passwd)
+{
+    m_lock.lock();
+    unordered_map<string, flight *>::iterator it = m_flights.find(name);
+    if (it == m_flights.end())
+    {
+        // 没有进行中的查询，自己去查，查询期间不持有锁
+        flight *f = new flight;
+        f->done = false;
+        f->result = -1;
+        f->refs = 1;
+        m_flights[name] = f;
+        m_lock.unlock();
+        __atomic_fetch_add(&m_leaders, 1, __ATOMIC_RELAXED);
+
+        string result_passwd;
+        int ret = store->query(name, result_passwd);
+
+        m_lock.lock();
+        f->done = true;
+        f->result = ret;
+        f->passwd = result_passwd;
+        // 先摘掉，之后到达的线程重新发起查询，不会拿到过时的结果
+        m_flights.erase(name);
+        f->done_cond.broadcast();
+        bool last = --f->refs == 0;
+        m_lock.unlock();
+        if (last)
+            delete f;
+
+        passwd = result_passwd;
+        return ret;
+    }
+
+    // 已有线程在查，等它的结果
+    flight *f = it->second;
+    ++f->refs;
+    __atomic_fetch_add(&m_followers, 1, __ATOMIC_RELAXED);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec deadline;
+    long long usec = now.tv_usec + (long long)m_timeout_ms * 1000;
+    deadline.tv_sec = now.tv_sec + usec / 1000000;
+    deadline.tv_nsec = usec % 1000000 * 1000;
+    while (!f->done)
+    {
+        if (m_timeout_ms <= 0)
+        {
+            f->done_cond.wait(m_lock.get());
+            continue;
+        }
+        // 超时返回时done仍为false，按出错处理
+        if (!f->done_cond.timewait(m_lock.get(), deadline) && !f->done)
+            break;
+    }
+    int ret = f->done ? f->result : -1;
+    if (ret == 1)
+        passwd = f->passwd;
+    bool last = --f->refs == 0;
+    m_lock.unlock();
+    if (last)
+        delete f;
+    return ret;
+}
@@ -0,0 +1,51 @@
+#ifndef USER_FLIGHT_H
+#define USER_FLIGHT_H
+
+#include <string>
+#include <unordered_map>
+#include "../CGImysql/user_store.h"
+#include "../lock/locker.h"
+
+using namespace std;
+
+// 合并同一用户名的并发查询（single-flight）：缓存未命中时第一个线程去查存储，
+// 同时查同一用户名的其他线程等它的结果，结果（包括出错）分给所有等待者，存储只被查一次
+// 部署后缓存还是冷的，热门账号被并发登录时，这样不会有一串相同的查询同时打到数据库上
+class user_flight
+{
+public:
+    // 单例模式
+    static user_flight *GetInstance();
+
+    // timeout_ms为等待者最多等多久，超时按查询出错处理
+    void init(int timeout_ms);
+
+    // 同user_store::query：找到返回1，不存在返回0，出错、拿不到连接或等待超时返回-1
+    int query(user_store *store, const char *name, string &passwd);
+
+    // 发起的查询次数，搭上别人查询的次数
+    long long leaders() { return __atomic_load_n(&m_leaders, __ATOMIC_RELAXED); }
+    long long followers() { return __atomic_load_n(&m_followers, __ATOMIC_RELAXED); }
+
+private:
+    user_flight();
+    ~user_flight();
+
+    // 一次进行中的查询，最后一个离开的线程释放
+    struct flight
+    {
+        cond done_cond;
+        bool done;
+        int result;
+        string passwd;
+        int refs;
+    };
+
+private:
+    int m_timeout_ms;
+    locker m_lock;                           // 保护m_flights和flight中除done_cond外的字段
+    unordered_map<string, flight *> m_flights; // 用户名到进行中的查询
+    long long m_leaders;
+    long long m_followers;
+};
+#endif
@@ -0,0 +1,170 @@
+#include <time.h>
+#include <sys/time.h>
+#include "user_snapshot.h"
+
+user_snapshot::user_snapshot()
+{
+    m_store = nullptr;
+    m_interval = 0;
+    m_full = false;
+    m_has_id = false;
+    m_reload = false;
+    m_hwm = 0;
+    m_running = false;
+    m_stop = false;
+    m_close_log = 0;
+}
+
+user_snapshot::~user_snapshot()
+{
+}
+
+user_snapshot *user_snapshot::GetInstance()
+{
+    static user_snapshot snapshot;
+    return &snapshot;
+}
+
+// 在用户缓存init之后、开始处理请求之前调用
+bool user_snapshot::init(user_store *store, const char *path, int interval, bool full, int close_log)
+{
+    m_store = store;
+    m_path = path;
+    m_interval = interval;
+    m_full = full;
+    m_close_log = close_log;
+    if (m_interval <= 0)
+        return false;
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    unsigned long long hwm = 0;
+    if (user_cache::GetInstance()->load(m_path.c_str(), hwm))
+    {
+        gettimeofday(&end, NULL);
+        long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+        // 快照可能过时，全量模式先用它处理请求，后台线程从头读一遍用户表
+        m_reload = m_full;
+        LOG_INFO("load user snapshot %s: %zu users, hwm %llu, %ldms", m_path.c_str(), user_cache::GetInstance()->size(), hwm, ms);
+    }
+
+    if (pthread_create(&m_tid, NULL, worker, this) != 0)
+    {
+        LOG_ERROR("%s", "create user snapshot thread failed");
+        // 没有后台线程，只能由调用者同步全量加载
+        user_cache::GetInstance()->drop_snapshot();
+        m_reload = false;
+        return false;
+    }
+    m_running = true;
+    return m_reload;
+}
+
+// 追读时每读到一行调用一次
+struct catch_up_state
+{
+    unsigned long long hwm;
+    long rows;
+};
+
+static void catch_up_row(void *arg, unsigned long long id, const char *name, const char *passwd)
+{
+    catch_up_state *state = (catch_up_state *)arg;
+    if (id > state->hwm)
+        state->hwm = id;
+    user_cache::GetInstance()->put(name, passwd);
+    ++state->rows;
+}
+
+bool user_snapshot::catch_up()
+{
+    catch_up_state state;
+    state.hwm = m_hwm;
+    state.rows = 0;
+    int ret = m_store->scan(m_hwm, catch_up_row, &state);
+    if (ret < 0)
+        return false;
+    // 返回0说明表里没有id列，已经全量读取，之后没法按hwm追读
+    m_has_id = ret == 1;
+    m_hwm = state.hwm;
+    LOG_INFO("user catch up from %s: %ld rows, hwm %llu", m_store->name(), state.rows, m_hwm);
+    return true;
+}
+
+void user_snapshot::stop()
+{
+    if (!m_running)
+        return;
+    m_lock.lock();
+    m_stop = true;
+    m_cond.signal();
+    m_lock.unlock();
+    pthread_join(m_tid, NULL);
+    m_running = false;
+    dump();
+}
+
+void *user_snapshot::worker(void *arg)
+{
+    user_snapshot *snapshot = (user_snapshot *)arg;
+    snapshot->run();
+    return snapshot;
+}
+
+bool user_snapshot::reload()
+{
+    m_hwm = 0;
+    if (!catch_up())
+    {
+        LOG_ERROR("reload users from %s failed, keep using the snapshot", m_store->name());
+        return false;
+    }
+    // 表里的用户都已经放进哈希表，快照里多出来的是已经删除的用户，和快照一起丢掉
+    user_cache::GetInstance()->drop_snapshot();
+    m_reload = false;
+    return true;
+}
+
+void user_snapshot::run()
+{
+    if (m_reload)
+        reload();
+    while (true)
+    {
+        m_lock.lock();
+        if (!m_stop)
+        {
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_sec += m_interval;
+            m_cond.timewait(m_lock.get(), t);
+        }
+        bool stop = m_stop;
+        m_lock.unlock();
+        if (stop)
+            break;
+        // 启动时重新读取失败的，每个周期重试
+        if (m_reload && !reload())
+            continue;
+        dump();
+    }
+}
+
+void user_snapshot::dump()
+{
+    if (m_full && m_has_id)
+        catch_up();
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    // 全量模式但没有id列时没法追读，hwm记0，下次启动仍然全量加载
+    unsigned long long hwm = m_full && m_has_id ? m_hwm : 0;
+    if (!user_cache::GetInstance()->save(m_path.c_str(), hwm))
+    {
+        LOG_ERROR("save user snapshot %s failed", m_path.c_str());
+        return;
+    }
+    gettimeofday(&end, NULL);
+    long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+    LOG_INFO("save user snapshot %s: hwm %llu, %ldms", m_path.c_str(), hwm, ms);
+}
@@ -0,0 +1,59 @@
+#ifndef USER_SNAPSHOT_H
+#define USER_SNAPSHOT_H
+
+#include <string>
+#include "user_cache.h"
+#include "../CGImysql/user_store.h"
+#include "../lock/locker.h"
+
+using namespace std;
+
+// 用户缓存的二进制快照，重启时直接mmap加载，不用等经MySQL协议一行行读完整张用户表就能处理登录
+// 快照里的密码可能已经过时（库里改了密码或删了用户），所以：
+// 全量模式加载快照后由后台线程重新全量读一遍用户表，读完后丢掉快照，以表为准
+// 限定容量模式快照只用来预热，登录时快照里的密码对不上就再查一次库
+// 快照记录高水位hwm：运行期间定期转储前只追读id > hwm的新用户，追读依赖user表有自增主键：
+// ALTER TABLE user ADD id INT AUTO_INCREMENT PRIMARY KEY FIRST; 没有id列时不追读
+class user_snapshot
+{
+public:
+    // 单例模式
+    static user_snapshot *GetInstance();
+
+    // 加载快照，interval为定期转储的秒数，0表示不用快照；full为真时缓存需要包含全部用户
+    // 全量模式加载了快照时返回true，全量读取交给后台线程，调用者不用再调用catch_up
+    bool init(user_store *store, const char *path, int interval, bool full, int close_log);
+    // 从存储读取id > hwm的用户放入缓存并推进hwm，没有快照时hwm为0即全量加载；user表没有id列时全量加载，出错返回false
+    bool catch_up();
+    // 停止后台线程，退出前再转储一次
+    void stop();
+
+private:
+    user_snapshot();
+    ~user_snapshot();
+
+    static void *worker(void *arg);
+    void run();
+    // 全量模式下先追读再写快照，保证hwm之前的用户都在快照里
+    void dump();
+    // 全量重新读取用户表，成功后丢掉启动时加载的快照
+    bool reload();
+
+private:
+    user_store *m_store;
+    string m_path;             // 快照文件路径
+    int m_interval;            // 转储间隔
+    bool m_full;               // 缓存是否包含全部用户
+    bool m_has_id;             // user表是否有自增id列
+    bool m_reload;             // 启动时加载了快照，还没全量重新读取过
+    unsigned long long m_hwm;  // 缓存中已包含的最大用户id
+    pthread_t m_tid;
+    bool m_running;            // 后台线程是否在运行
+    bool m_stop;
+    locker m_lock;
+    cond m_cond;
+
+public:
+    int m_close_log; // 日志开关
+};
+#endif
@@ -5,9 +5,21 @@ Config::Config()
     //端口号,默认9006
     PORT = 9006;
 
-    //日志写入方式，默认同步
+    //日志写入方式，默认同步，1为异步，2为异步写二进制日志
     LOGWrite = 0;
 
+    //日志级别，默认INFO，运行中可用SIGUSR1/SIGUSR2调低/调高
+    LOGLevel = 1;
+
+    //异步日志暂存区满时默认按级别丢弃，不让写日志拖慢请求；只有0会等待写出
+    LOGOverflow = 2;
+
+    //日志默认每秒刷盘一次
+    LOGFlush = 1000;
+
+    //访问日志默认记下1%的2xx、10%的3xx和全部4xx、5xx
+    access_rates = "1,10,100,100";
+
     //触发组合模式， 默认都是LT
     TRIGMode = 0;
 
@@ -20,12 +32,42 @@ Config::Config()
     //默认不使用优雅关闭
     OPT_LINGER = 0;
 
-    //数据库连接池中连接数量默认为8
+    //数据库连接池中连接数量默认最多8条
     sql_num = 8;
 
+    //数据库连接池启动时默认建立2条连接，之后按需增长
+    sql_min = 2;
+
     //线程池中线程数默认为8
     thread_num = 8;
 
+    //线程池最大线程数默认为32
+    max_thread_num = 32;
+
+    //数据库线程池中线程数默认为4
+    db_thread_num = 4;
+
+    //默认同步查询数据库
+    sql_async = 0;
+
+    //用户缓存默认最多65536个，未命中时按需查库
+    user_cache = 65536;
+
+    //默认不开启用户名过滤器
+    user_filter = 0;
+
+    //用户缓存快照默认每300秒转储一次
+    snapshot_interval = 300;
+
+    //默认工作线程从共享连接池取数据库连接
+    sql_local = 0;
+
+    //默认用户表存在MySQL中
+    user_store = 0;
+
+    //进程内存储默认不注入延迟
+    store_latency = 0;
+
     //默认不关闭日志
     close_log = 0;
 
@@ -37,7 +79,7 @@ void Config::parse_arg(int argc, char *argv[])
 {
     int opt;
     //单字符后加：表示之后必须带一个参数
-    const char* str  = "p:l:m:o:s:t:c:a:";
+    const char* str  = "p:l:v:f:i:r:m:o:s:t:c:a:x:d:q:u:g:k:w:n:b:e:";
     //获取参数列表
     while((opt = getopt(argc, argv, str)) != -1)
     {
@@ -53,6 +95,26 @@ void Config::parse_arg(int argc, char *argv[])
             LOGWrite = atoi(optarg);
             break;
         }
+        case 'v':
+        {
+            LOGLevel = atoi(optarg);
+            break;
+        }
+        case 'f':
+        {
+            LOGOverflow = atoi(optarg);
+            break;
+        }
+        case 'i':
+        {
+            LOGFlush = atoi(optarg);
+            break;
+        }
+        case 'r':
+        {
+            access_rates = optarg;
+            break;
+        }
         case 'm':
         {
             OPT_LINGER = atoi(optarg);
@@ -73,6 +135,56 @@ void Config::parse_arg(int argc, char *argv[])
             actor_model = atoi(optarg);
             break;
         }
+        case 'x':
+        {
+            max_thread_num = atoi(optarg);
+            break;
+        }
+        case 'd':
+        {
+            db_thread_num = atoi(optarg);
+            break;
+        }
+        case 'q':
+        {
+            sql_async = atoi(optarg);
+            break;
+        }
+        case 'u':
+        {
+            user_cache = atoi(optarg);
+            break;
+        }
+        case 'g':
+        {
+            user_filter = atoi(optarg);
+            break;
+        }
+        case 'k':
+        {
+            snapshot_interval = atoi(optarg);
+            break;
+        }
+        case 'w':
+        {
+            sql_local = atoi(optarg);
+            break;
+        }
+        case 'n':
+        {
+            sql_min = atoi(optarg);
+            break;
+        }
+        case 'b':
+        {
+            user_store = atoi(optarg);
+            break;
+        }
+        case 'e':
+        {
+            store_latency = atoi(optarg);
+            break;
+        }
         default:
             break;
         }
@@ -19,6 +19,18 @@ public:
     //日志写入方式
     int LOGWrite;
 
+    //运行期日志级别，0 DEBUG 1 INFO 2 WARN 3 ERROR
+    int LOGLevel;
+
+    //异步日志暂存区满时的处理方式，0等待 1丢弃 2按级别丢弃（高水位以上优先留给ERROR） 3采样
+    int LOGOverflow;
+
+    //日志刷盘间隔（毫秒），空闲时也按这个间隔把缓冲的日志写进文件
+    int LOGFlush;
+
+    //访问日志2xx、3xx、4xx、5xx的采样百分比，逗号分隔，全为0时不写访问日志
+    string access_rates;
+
     //触发组合模式
     int TRIGMode;
 
@@ -31,12 +43,42 @@ public:
     //优雅关闭连接
     int OPT_LINGER;
 
-    //数据库连接池数量
+    //数据库连接池数量（最大连接数）
     int sql_num;
 
-    //线程池中线程数量
+    //数据库连接池启动时建立的连接数
+    int sql_min;
+
+    //线程池中线程数量（最小线程数）
     int thread_num;
 
+    //线程池最大线程数，大于thread_num时线程池根据负载伸缩
+    int max_thread_num;
+
+    //数据库线程池中线程数量，为0时登录、注册请求在普通线程池中处理
+    int db_thread_num;
+
+    //是否把数据库查询挂到epoll上异步执行（需要mariadb客户端）
+    int sql_async;
+
+    //用户缓存容量，0表示启动时全量加载用户表
+    int user_cache;
+
+    //是否用布隆过滤器挡掉不存在的用户名，启动时要扫一遍用户表，多个实例共用一个库时不能开启
+    int user_filter;
+
+    //用户缓存快照的转储间隔（秒），0表示不用快照，只用于MySQL存储
+    int snapshot_interval;
+
+    //工作线程是否各自独占一条数据库连接
+    int sql_local;
+
+    //用户表存储后端，0为MySQL，1为进程内存储，2为嵌入式文件存储
+    int user_store;
+
+    //进程内存储每次访问注入的延迟（微秒）
+    int store_latency;
+
     //是否关闭日志
     int close_log;
 
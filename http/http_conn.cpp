@@ -1,4 +1,7 @@
 #include "http_conn.h"
+#include "../CGImysql/register_batch.h"
+#include "../cache/user_cache.h"
+#include "../cache/user_filter.h"
 
 #include <mysql/mysql.h>
 #include <fstream>
@@ -13,41 +16,17 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual probliem serving the request file.\n";
-
-// 互斥锁
-locker m_lock;
-// 存储数据库中已存在的账户信息，用于登陆验证
-map<string, string> users;
-
-void http_conn::initmysql_result(connection_pool *connPool)
-{
-    // 先从连接池中取出一个连接
-    MYSQL *mysql = nullptr;
-    connectionRAII mysqlcon(&mysql, connPool);
-
-    // mysql_query执行查询语句
-    if (mysql_query(mysql, "SELECT username, passwd FROM user"))
-    {
-        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
-    }
-
-    // 使用mysql_store_result
-    MYSQL_RES *result = mysql_store_result(mysql);
-
-    // 使用mysql_num_fields(result)获取查询的列数，mysql_num_rows(result)获取结果集的行数，没有用到
-    int num_fields = mysql_num_fields(result);
-
-    // 返回所有字段结构的数组,没有用到
-    MYSQL_FIELD *fields = mysql_fetch_fields(result);
-
-    // 通过mysql_fetch_row(result)不断获取下一行，存入map中
-    while (MYSQL_ROW row = mysql_fetch_row(result))
-    {
-        string temp1(row[0]);
-        string temp2(row[1]);
-        users[temp1] = temp2;
-    }
-}
+const char *error_503_title = "Service Unavailable";
+const char *error_503_form = "The database is busy, please try again later.\n";
+
+// 存储数据库中已存在的账户信息，用于登陆验证，内部分片加读写锁，多个工作线程可以并发查找
+user_cache *users = user_cache::GetInstance();
+// 全部用户名的布隆过滤器，按需加载模式下用来跳过不存在用户的缓存和数据库查询
+user_filter *user_names = user_filter::GetInstance();
+// 缓存未命中时合并同一用户名的并发查询
+user_flight *user_queries = user_flight::GetInstance();
+// 登录后的会话，带会话cookie的请求不用再校验密码
+session_cache *sessions = session_cache::GetInstance();
 
 // 将文件描述符设置为非阻塞的，Utils工具类中也有相同作用的函数
 int setnonblocking(int fd)
@@ -101,6 +80,33 @@ void modfd(int epollfd, int fd, int ev, int TRIGMode)
 
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+connection_pool *http_conn::m_connPool = nullptr;
+user_store *http_conn::m_store = nullptr;
+int http_conn::m_sql_async = 0;
+
+// 一次异步插入用到的数据库连接、语句和参数，参数在查询完成前必须一直有效
+struct sql_async
+{
+    http_conn *conn;      // 等结果的http连接，连接先被关闭时为nullptr
+    int sockfd;           // 客户连接的socket
+    unsigned gen;         // 发起时客户socket的关闭次数，和sql_conn_gen不同说明连接已经关闭过
+    MYSQL *mysql;         // 占用的数据库连接
+    MYSQL_STMT *stmt;     // 预编译的单行插入语句
+    int fd;               // 数据库连接的socket
+    MYSQL_BIND bind[2];
+    unsigned long len[2];
+    char name[100];       // 注册的用户名
+    char passwd[100];     // 注册的密码
+};
+
+// 数据库socket fd和客户socket fd到等待中的异步插入的映射，由数据库线程池注册、主线程读取和清除
+const int MAX_SQL_FD = 65536;
+static sql_async *sql_waiters[MAX_SQL_FD];
+static sql_async *sql_clients[MAX_SQL_FD];
+// 每个客户socket fd被关闭的次数，只由主线程在关闭时增加；fd被复用后次数和发起插入时记下的不同
+static unsigned sql_conn_gen[MAX_SQL_FD];
+// 数据库线程池登记插入和主线程关闭连接互斥，登记时连接要么还没关闭，要么已经能看出关闭过
+static locker sql_lock;
 
 // 异常关闭连接，process_write中写失败，调用它。还有一个关闭函数是timer里面的cbfunc
 void http_conn::close_conn(bool real_close)
@@ -108,6 +114,7 @@ void http_conn::close_conn(bool real_close)
     if (real_close && (m_sockfd != -1))
     {
         printf("close %d\n", m_sockfd);
+        abandon_sql(m_sockfd);
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
         m_user_count--;
@@ -133,6 +140,8 @@ void http_conn::init(int sockfd, const sockaddr_in &addr, char *root, int TRIGMo
     strcpy(sql_user, user.c_str());
     strcpy(sql_passwd, passwd.c_str());
     strcpy(sql_name, sqlname.c_str());
+    // 新连接要重新按跟踪规则匹配一次
+    m_trace_gen = -1;
     // 初始化http对象的其他部分。在长连接时，处理完http请求也会调用这个无参的重置连接
     init();
 }
@@ -141,7 +150,6 @@ void http_conn::init(int sockfd, const sockaddr_in &addr, char *root, int TRIGMo
 // check_state默认为分析请求行状态
 void http_conn::init()
 {
-    mysql = NULL;
     bytes_to_send = 0;
     bytes_have_send = 0;
     m_check_state = CHECK_STATE_REQUESTLINE;
@@ -151,6 +159,16 @@ void http_conn::init()
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
+    m_cookie[0] = '\0';
+    m_new_session[0] = '\0';
+    m_path[0] = '\0';
+    m_referer = 0;
+    m_agent = 0;
+    m_start_us = 0;
+    m_parsed_us = 0;
+    m_replied_us = 0;
+    m_status = 0;
+    m_body_len = 0;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
@@ -159,6 +177,19 @@ void http_conn::init()
     m_state = 0;
     timer_flag = 0;
     improv = 0;
+    db_flag = 0;
+    m_async = nullptr;
+    m_sql_gen = 0;
+
+    // 跟踪规则重新加载过才重新匹配，平时只比较一次版本号
+    trace_filter *trace = trace_filter::GetInstance();
+    int gen = trace->generation();
+    if (gen != m_trace_gen)
+    {
+        m_trace_conn = gen > 0 && trace->match_conn(m_address.sin_addr, m_sockfd);
+        m_trace_gen = gen;
+    }
+    m_trace = m_trace_conn;
 
     memset(m_read_buf, '\0', READ_BUFFER_SIZE);
     memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
@@ -227,6 +258,8 @@ bool http_conn::read_once()
         {
             return false;
         }
+        if (m_start_us == 0)
+            m_start_us = access_log::now_us();
         return true;
     }
     else // ET,读到缓冲区内无数据
@@ -246,6 +279,8 @@ bool http_conn::read_once()
             {
                 return false;
             }
+            if (m_start_us == 0)
+                m_start_us = access_log::now_us();
             m_read_idx += bytes_read;
         }
         return true;
@@ -318,6 +353,19 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     if (!m_url || m_url[0] != '/')
         return BAD_REQUEST;
 
+    // 先留一份原始路径给访问日志
+    strncpy(m_path, m_url, FILENAME_LEN - 1);
+    m_path[FILENAME_LEN - 1] = '\0';
+
+    // 连接没有被跟踪时再按路径前缀匹配这个请求
+    if (!m_trace)
+    {
+        trace_filter *trace = trace_filter::GetInstance();
+        if (trace->has_url_rules())
+            m_trace = trace->match_url(m_path);
+    }
+    LOG_TRACE(m_trace, "fd %d request %s %s", m_sockfd, method, m_path);
+
     // 当url为/时，显示判断界面（首页）
     if (strlen(m_url) == 1)
         strcat(m_url, "judge.html");
@@ -365,9 +413,39 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
         text += strspn(text, " \t");
         m_host = text;
     }
+    // 解析cookie字段，只取出会话令牌，其他cookie忽略
+    else if (strncasecmp(text, "Cookie:", 7) == 0)
+    {
+        text += 7;
+        const size_t name_len = sizeof(SESSION_COOKIE) - 1;
+        while (*text)
+        {
+            text += strspn(text, " \t;");
+            size_t len = strcspn(text, ";");
+            if (len == name_len + 1 + SESSION_TOKEN_LEN && strncmp(text, SESSION_COOKIE, name_len) == 0 && text[name_len] == '=')
+            {
+                memcpy(m_cookie, text + name_len + 1, SESSION_TOKEN_LEN);
+                m_cookie[SESSION_TOKEN_LEN] = '\0';
+            }
+            text += len;
+        }
+    }
+    // 访问日志要记下Referer和User-Agent
+    else if (strncasecmp(text, "Referer:", 8) == 0)
+    {
+        text += 8;
+        text += strspn(text, " \t");
+        m_referer = text;
+    }
+    else if (strncasecmp(text, "User-Agent:", 11) == 0)
+    {
+        text += 11;
+        text += strspn(text, " \t");
+        m_agent = text;
+    }
     else
     {
-        LOG_INFO("opp!unknow header; %s", text);
+        LOG_TRACE(m_trace, "fd %d opp!unknow header; %s", m_sockfd, text);
     }
     return NO_REQUEST;
 }
@@ -402,7 +480,7 @@ http_conn::HTTP_CODE http_conn::process_read()
         // 取一行,更新下一行的位置
         text = get_line();
         m_start_line = m_checked_idx;
-        LOG_INFO("%s", text);
+        LOG_TRACE(m_trace, "fd %d %s", m_sockfd, text);
         // 主状态机逻辑转移
         switch (m_check_state)
         {
@@ -422,6 +500,7 @@ http_conn::HTTP_CODE http_conn::process_read()
                 return BAD_REQUEST;
             else if (ret == GET_REQUEST)
             {
+                m_parsed_us = access_log::now_us();
                 return do_request();
             }
             break;
@@ -431,7 +510,10 @@ http_conn::HTTP_CODE http_conn::process_read()
             // 解析请求体
             ret = parse_content(text);
             if (ret == GET_REQUEST)
+            {
+                m_parsed_us = access_log::now_us();
                 return do_request();
+            }
             line_status = LINE_OPEN;
             break;
         }
@@ -445,6 +527,7 @@ http_conn::HTTP_CODE http_conn::process_read()
     }
     else // 语法错误
     {
+        LOG_TRACE(m_trace, "fd %d bad line at %d", m_sockfd, m_checked_idx);
         return BAD_REQUEST;
     }
 }
@@ -458,8 +541,20 @@ http_conn::HTTP_CODE http_conn::do_request()
     const char *p = strrchr(m_url, '/');
 
     // 如果是POST请求,即登录或者注册(cgi == 1)
-    if (cgi == 1 && (*(p + 1) == '2' || *(p + 1) == '3'))
+    // db_flag为3说明异步查询已经完成,m_url已经是结果页面,直接往下映射文件
+    if (cgi == 1 && db_flag != 3 && (*(p + 1) == '2' || *(p + 1) == '3'))
     {
+        // 需要访问数据库，先交给数据库线程池，避免静态资源请求排在数据库请求后面
+        if (db_flag == 0)
+        {
+            db_flag = 1;
+            // 此时连接还在处理这个请求，记下fd的关闭次数，异步插入登记时用来判断连接是否已经关闭
+            if (m_sockfd >= 0 && m_sockfd < MAX_SQL_FD)
+                m_sql_gen = __atomic_load_n(&sql_conn_gen[m_sockfd], __ATOMIC_ACQUIRE);
+            LOG_TRACE(m_trace, "fd %d %s goes to db pool", m_sockfd, m_url);
+            return DB_REQUEST;
+        }
+
         // 提取用户名和密码
         // user=123&password=123
         char name[100], password[100];
@@ -479,43 +574,61 @@ http_conn::HTTP_CODE http_conn::do_request()
         // 注册
         if (*(p + 1) == '3')
         {
-            // 插入新数据的sql命令字符串
-            char *sql_insert = (char *)malloc(sizeof(char) * 200);
-            strcpy(sql_insert, "INSERT INTO user(username, passwd) VALUES(");
-            strcat(sql_insert, "'");
-            strcat(sql_insert, name);
-            strcat(sql_insert, "', '");
-            strcat(sql_insert, password);
-            strcat(sql_insert, "')");
-
             // 插入前先看有没有重复的
-            if (users.find(name) == users.end())
+            string exist;
+            USER_LOOKUP found = load_user(name, exist);
+            // 拿不到数据库连接或查询出错，没法确定用户名是否已存在
+            if (found == USER_MISS)
+                return SERVICE_UNAVAILABLE;
+            if (found != USER_FOUND)
             {
-                m_lock.lock();
-                // 调用mysql_query插入数据
-                int res = mysql_query(mysql, sql_insert);               
-                // 校验成功,返回登陆页面
-                if (!res)
+                // 开启异步时插入语句挂到epoll上，工作线程直接返回，不用等数据库往返
+                int async = m_sql_async ? async_insert(name, password) : -1;
+                if (async == 1)
+                    return ASYNC_REQUEST;
+                // 异步插入没能发起，同步插入；async为0时已同步完成，m_url已设置
+                if (async == -1)
                 {
-                    strcpy(m_url, "/log.html");
-                    // 没问题的话更新哈希表
-                    users.insert(pair<string, string>(name, password));
-                    m_lock.unlock();
-                }
-                else
-                {
-                    // 校验失败，跳转注册失败页面（因为在获取锁的等待时间里，有其他用户注册了相同的用户名）
-                    strcpy(m_url, "/registerError.html");
+                    // 交给组提交，和同一时间窗口内的其他注册合并成一条多行插入
+                    int inserted = register_batch::GetInstance()->submit(name, password);
+                    if (inserted == -1)
+                        return SERVICE_UNAVAILABLE;
+                    if (inserted == 1)
+                    {
+                        // 校验成功,没问题的话更新过滤器和哈希表,返回登陆页面
+                        user_names->add(name);
+                        users->put(name, password);
+                        strcpy(m_url, "/log.html");
+                    }
+                    else
+                    {
+                        // 校验失败，跳转注册失败页面（因为在获取锁的等待时间里，有其他用户注册了相同的用户名）
+                        strcpy(m_url, "/registerError.html");
+                    }
                 }
             }
             else
                 strcpy(m_url, "/registedError.html");
         }
-        // 如果是登录,直接判断
+        // 如果是登录,查缓存(未命中时查库)后判断
         else if (*(p + 1) == '2')
         {
-            if (users.find(name) != users.end() && users[name] == password)
+            string passwd;
+            bool snapshot = false;
+            USER_LOOKUP found = load_user(name, passwd, &snapshot);
+            // 快照里的密码可能已经在库里改过，对不上时以库为准再查一次
+            if (found == USER_FOUND && snapshot && passwd != password)
+                found = query_user(name, passwd);
+            if (found == USER_MISS)
+                return SERVICE_UNAVAILABLE;
+            if (found == USER_FOUND && passwd == password)
             {
+                // 新建会话，之后的请求带着cookie就不用再登录；取不到随机数时只是不设置cookie
+                // 带着旧会话重新登录的（可能换了用户）先删掉旧会话，不沿用登录前的令牌
+                if (m_cookie[0])
+                    sessions->remove(m_cookie);
+                if (!sessions->create(name, m_new_session))
+                    m_new_session[0] = '\0';
                 strcpy(m_url, "/welcome.html");
             }
             else
@@ -537,7 +650,11 @@ http_conn::HTTP_CODE http_conn::do_request()
     else if (*(p + 1) == '1') // 请求登陆界面
     {
         char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/log.html");
+        // 已经登录过的直接进欢迎页；只用于GET登录页，提交登录表单时总要校验密码
+        if (m_cookie[0] && sessions->lookup(m_cookie, NULL))
+            strcpy(m_url_real, "/welcome.html");
+        else
+            strcpy(m_url_real, "/log.html");
         strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
         free(m_url_real);
     }
@@ -573,12 +690,14 @@ http_conn::HTTP_CODE http_conn::do_request()
     // 失败的话说明文件不存在
     if (stat(m_real_file, &m_file_stat) < 0)
     {
+        LOG_TRACE(m_trace, "fd %d %s not found", m_sockfd, m_real_file);
         return NO_RESOURCE;
     }
 
     // 判断文件权限是否可读,不可读返回FORBIDDEN_REQUEST状态
     if (!(m_file_stat.st_mode & S_IROTH))
     {
+        LOG_TRACE(m_trace, "fd %d %s forbidden", m_sockfd, m_real_file);
         return FORBIDDEN_REQUEST;
     }
 
@@ -602,10 +721,231 @@ http_conn::HTTP_CODE http_conn::do_request()
     // 避免文件描述符的浪费和占用
     close(fd);
 
+    LOG_TRACE(m_trace, "fd %d %s -> %s (%ld bytes)", m_sockfd, m_url, m_real_file, (long)m_file_stat.st_size);
     // 表示请求文件存在，且可以访问
     return FILE_REQUEST;
 }
 
+// 先查缓存，按需加载模式下未命中再按用户名查存储，并回填缓存（不存在的用户名记负缓存）
+USER_LOOKUP http_conn::load_user(const char *name, string &passwd, bool *snapshot)
+{
+    if (snapshot)
+        *snapshot = false;
+    // 过滤器说一定不存在，缓存和数据库都不用查
+    if (user_names->enabled() && !user_names->may_contain(name))
+        return USER_ABSENT;
+
+    USER_LOOKUP ret = users->lookup(name, passwd, snapshot);
+    if (ret != USER_MISS)
+        return ret;
+    // 不限容量时启动已全量加载用户表，未命中就是不存在
+    if (!users->bounded())
+        return USER_ABSENT;
+    return query_user(name, passwd);
+}
+
+USER_LOOKUP http_conn::query_user(const char *name, string &passwd)
+{
+    // 同一用户名已经有线程在查时等它的结果，不重复查询
+    int found = user_queries->query(m_store, name, passwd);
+    if (found == 1)
+    {
+        users->put(name, passwd.c_str());
+        return USER_FOUND;
+    }
+    if (found == 0)
+    {
+        if (user_names->enabled())
+            user_names->report_false_positive();
+        users->put_negative(name);
+        return USER_ABSENT;
+    }
+    // 查询出错或拿不到连接，不缓存
+    return USER_MISS;
+}
+
+#ifdef SQL_ASYNC_SUPPORTED
+// 把mariadb要等待的事件转换成epoll事件，注册为oneshot，一次只有主线程处理
+static void wait_sql(sql_async *op, int status, int ctl)
+{
+    epoll_event event;
+    event.data.fd = op->fd;
+    event.events = EPOLLONESHOT;
+    if (status & MYSQL_WAIT_READ)
+        event.events |= EPOLLIN;
+    if (status & MYSQL_WAIT_WRITE)
+        event.events |= EPOLLOUT;
+    if (status & MYSQL_WAIT_EXCEPT)
+        event.events |= EPOLLPRI;
+    epoll_ctl(http_conn::m_epollfd, ctl, op->fd, &event);
+}
+#endif
+
+// 插入结束，归还数据库连接，成功时更新过滤器和用户表，返回是否成功
+static bool finish_sql(sql_async *op, int err)
+{
+    http_conn::m_connPool->ReleaseConnection(op->mysql);
+    if (err)
+        return false;
+    user_names->add(op->name);
+    users->put(op->name, op->passwd);
+    return true;
+}
+
+// 发起异步插入，数据库连接在查询结束前一直被这次插入占用
+int http_conn::async_insert(const char *name, const char *password)
+{
+#ifdef SQL_ASYNC_SUPPORTED
+    MYSQL *mysql = m_connPool->GetConnection();
+    if (!mysql)
+        return -1;
+    // 使用连接上预编译的单行插入语句
+    MYSQL_STMT *stmt = m_connPool->GetInsertStmt(mysql, 1);
+    if (!stmt)
+    {
+        m_connPool->ReleaseConnection(mysql);
+        return -1;
+    }
+
+    sql_async *op = new sql_async;
+    memset(op, 0, sizeof(*op));
+    op->conn = this;
+    op->sockfd = m_sockfd;
+    op->gen = m_sql_gen;
+    op->mysql = mysql;
+    op->stmt = stmt;
+    op->fd = mysql_get_socket(mysql);
+    strncpy(op->name, name, sizeof(op->name) - 1);
+    strncpy(op->passwd, password, sizeof(op->passwd) - 1);
+    for (int i = 0; i < 2; ++i)
+    {
+        char *value = i == 0 ? op->name : op->passwd;
+        op->len[i] = strlen(value);
+        op->bind[i].buffer_type = MYSQL_TYPE_STRING;
+        op->bind[i].buffer = value;
+        op->bind[i].buffer_length = op->len[i];
+        op->bind[i].length = &op->len[i];
+    }
+    if (mysql_stmt_bind_param(stmt, op->bind))
+    {
+        m_connPool->ReleaseConnection(mysql);
+        delete op;
+        return -1;
+    }
+    m_async = op;
+
+    int err = 0;
+    int status = mysql_stmt_execute_start(&err, stmt);
+    if (status == 0)
+    {
+        // 查询在发起时就完成了
+        end_async_insert(err);
+        return 0;
+    }
+    if (op->fd < 0 || op->fd >= MAX_SQL_FD || op->sockfd < 0 || op->sockfd >= MAX_SQL_FD)
+    {
+        // 拿不到socket没法放进epoll，只能在当前线程把查询做完
+        while (status)
+            status = mysql_stmt_execute_cont(&err, stmt, status);
+        end_async_insert(err);
+        return 0;
+    }
+
+    // 先登记再注册epoll，保证主线程收到事件时能找到这次插入，注册之后不能再访问本对象
+    // 请求在数据库线程池排队时连接可能已被关闭，fd也可能已被新连接复用，这时插入照常做完，只是不再回写响应
+    db_flag = 3;
+    sql_lock.lock();
+    if (sql_conn_gen[op->sockfd] == op->gen)
+        sql_clients[op->sockfd] = op;
+    else
+        op->conn = nullptr;
+    sql_lock.unlock();
+    sql_waiters[op->fd] = op;
+    wait_sql(op, status, EPOLL_CTL_ADD);
+    return 1;
+#else
+    return -1;
+#endif
+}
+
+bool http_conn::sql_waiting(int fd)
+{
+    return fd >= 0 && fd < MAX_SQL_FD && sql_waiters[fd] != nullptr;
+}
+
+// 主线程收到数据库socket的事件，继续执行查询，完成后生成响应报文
+void http_conn::sql_event(int fd, uint32_t events)
+{
+#ifdef SQL_ASYNC_SUPPORTED
+    sql_async *op = sql_waiters[fd];
+    int status = 0;
+    if (events & EPOLLIN)
+        status |= MYSQL_WAIT_READ;
+    if (events & EPOLLOUT)
+        status |= MYSQL_WAIT_WRITE;
+    if (events & (EPOLLPRI | EPOLLERR | EPOLLHUP))
+        status |= MYSQL_WAIT_EXCEPT;
+
+    int err = 0;
+    status = mysql_stmt_execute_cont(&err, op->stmt, status);
+    if (status)
+    {
+        // 还没完成，按新的等待事件重新注册
+        wait_sql(op, status, EPOLL_CTL_MOD);
+        return;
+    }
+
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, 0);
+    sql_waiters[fd] = nullptr;
+    // 关闭次数只由主线程修改，这里读到的就是最新的
+    http_conn *conn = op->conn;
+    if (!conn || sql_conn_gen[op->sockfd] != op->gen)
+    {
+        // 客户连接已经关闭，只归还数据库连接
+        finish_sql(op, err);
+        delete op;
+        return;
+    }
+    sql_lock.lock();
+    sql_clients[op->sockfd] = nullptr;
+    sql_lock.unlock();
+    conn->end_async_insert(err);
+
+    // 继续do_request剩下的部分（映射结果页面）并写响应
+    conn->process_reply(conn->do_request());
+#endif
+}
+
+// 客户连接被定时器或异常关闭时，fd随后可能被新连接复用，等待中的插入不能再指向这个http对象
+void http_conn::abandon_sql(int sockfd)
+{
+    if (sockfd < 0 || sockfd >= MAX_SQL_FD)
+        return;
+    sql_lock.lock();
+    // 关闭次数加一，之后才登记的插入能看出连接已经关闭
+    __atomic_add_fetch(&sql_conn_gen[sockfd], 1, __ATOMIC_RELEASE);
+    if (sql_clients[sockfd])
+    {
+        sql_clients[sockfd]->conn = nullptr;
+        sql_clients[sockfd] = nullptr;
+    }
+    sql_lock.unlock();
+}
+
+// 异步插入结束，err为0表示插入成功
+void http_conn::end_async_insert(int err)
+{
+    sql_async *op = m_async;
+    m_async = nullptr;
+    db_flag = 3;
+
+    if (finish_sql(op, err))
+        strcpy(m_url, "/log.html");
+    else
+        strcpy(m_url, "/registerError.html");
+    delete op;
+}
+
 // 取消文件映射
 void http_conn::unmap()
 {
@@ -638,11 +978,13 @@ bool http_conn::write()
             // EAGAIN发生了写阻塞
             if (errno == EAGAIN)
             {
+                LOG_TRACE(m_trace, "fd %d send blocked, %d bytes left", m_sockfd, bytes_to_send);
                 modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode);
                 return true;
             }
 
             // 其他错误取消映射,返回错误
+            LOG_TRACE(m_trace, "fd %d send failed, errno %d", m_sockfd, errno);
             unmap();
             return false;
         }
@@ -668,6 +1010,8 @@ bool http_conn::write()
         // 判断数据是否已发送完
         if (bytes_to_send <= 0)
         {
+            LOG_TRACE(m_trace, "fd %d sent %d bytes, status %d", m_sockfd, bytes_have_send, m_status);
+            log_access();
             unmap();
             // 重新监听EPOLLIN
             modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
@@ -686,6 +1030,36 @@ bool http_conn::write()
     }
 }
 
+void http_conn::log_access()
+{
+    access_log *log = access_log::GetInstance();
+    if (!log->sample(m_status))
+        return;
+
+    static const char *methods[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+    long long now = access_log::now_us();
+    // 没有经过某个阶段（比如请求有语法错误）时用前一个时间点，该阶段耗时记为0
+    long long start = m_start_us ? m_start_us : now;
+    long long parsed = m_parsed_us ? m_parsed_us : start;
+    long long replied = m_replied_us ? m_replied_us : parsed;
+
+    access_entry entry;
+    entry.addr = m_address.sin_addr;
+    entry.method = methods[m_method];
+    entry.path = m_path;
+    // 只接受HTTP/1.1；m_version指向读缓冲区，可能已被do_request改写m_url时覆盖
+    entry.version = m_check_state != CHECK_STATE_REQUESTLINE ? "HTTP/1.1" : nullptr;
+    entry.referer = m_referer;
+    entry.agent = m_agent;
+    entry.status = m_status;
+    entry.bytes = m_body_len;
+    entry.recv_us = parsed - start;
+    entry.handle_us = replied - parsed;
+    entry.send_us = now - replied;
+    entry.total_us = now - start;
+    log->write(entry);
+}
+
 // 利用可变参数列表，将报文写入http写缓冲区
 bool http_conn::add_response(const char *format, ...)
 {
@@ -713,26 +1087,28 @@ bool http_conn::add_response(const char *format, ...)
     // 更新已写入长度
     m_write_idx += len;
     va_end(arg_list);
-    LOG_INFO("request:%s", m_write_buf);
+    LOG_TRACE(m_trace, "fd %d response:%s", m_sockfd, m_write_buf + m_write_idx - len);
     return true;
 }
 
 // 添加状态行
 bool http_conn::add_status_line(int status, const char *title)
 {
+    m_status = status;
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
 // 添加消息报头，具体的添加文本长度、连接状态和空行
 bool http_conn::add_headers(int content_len)
 {
-    return add_content_length(content_len) && add_linger() &&
+    return add_content_length(content_len) && add_linger() && add_date() &&
            add_blank_line();
 }
 
 // 添加Content-Length，表示响应报文的长度
 bool http_conn::add_content_length(int content_len)
 {
+    m_body_len = content_len;
     return add_response("Content-Length:%d\r\n", content_len);
 }
 
@@ -748,6 +1124,14 @@ bool http_conn::add_linger()
     return add_response("Connection:%s\r\n", (m_linger == true) ? "keep-alive" : "close");
 }
 
+// 添加Date，用缓存时钟每秒格式化一次的字符串
+bool http_conn::add_date()
+{
+    clock_text now;
+    clock_cache::text(now);
+    return add_response("Date:%s\r\n", now.http);
+}
+
 // 添加空行
 bool http_conn::add_blank_line()
 {
@@ -777,6 +1161,16 @@ bool http_conn::process_write(HTTP_CODE ret)
             return false;
         break;
     }
+    // 数据库连接池等待超时，503，让客户端稍后重试而不是一直挂着
+    case SERVICE_UNAVAILABLE:
+    {
+        add_status_line(503, error_503_title);
+        add_response("Retry-After:%d\r\n", 1);
+        add_headers(strlen(error_503_form));
+        if (!add_content(error_503_form))
+            return false;
+        break;
+    }
     // 报文语法有误，404
     case BAD_REQUEST:
     {
@@ -799,6 +1193,8 @@ bool http_conn::process_write(HTTP_CODE ret)
     case FILE_REQUEST:
     {
         add_status_line(200, ok_200_title);
+        if (m_new_session[0])
+            add_response("Set-Cookie:%s=%s; Path=/; Max-Age=%d; HttpOnly\r\n", SESSION_COOKIE, m_new_session, sessions->ttl());
         // 如果文件大小不为0，则消息体长度就是文件长度
         if (m_file_stat.st_size != 0)
         {
@@ -849,8 +1245,31 @@ void http_conn::process()
         modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
         return;
     }
+    // 需要访问数据库，由线程池转交给数据库线程池，这里先不写
+    if (read_ret == DB_REQUEST)
+    {
+        return;
+    }
+    process_reply(read_ret);
+}
+
+// 由数据库线程池调用，报文已经在process中解析完，这里只需重新执行do_request访问数据库
+void http_conn::process_db()
+{
+    db_flag = 2;
+    HTTP_CODE ret = do_request();
+    // 查询挂在epoll上，由主线程在结果返回后继续，这里不能再访问本对象
+    if (ret == ASYNC_REQUEST)
+        return;
+    process_reply(ret);
+}
+
+// 根据请求处理结果写响应报文，并通知主线程可写
+void http_conn::process_reply(HTTP_CODE read_ret)
+{
     // 解析处理完后写
     bool write_ret = process_write(read_ret);
+    m_replied_us = access_log::now_us();
     // 写错误，关闭连接
     if (!write_ret)
     {
@@ -23,8 +23,23 @@
 
 #include "../lock/locker.h"
 #include "../CGImysql/sql_connection_pool.h"
+#include "../CGImysql/user_store.h"
 #include "../timer/lst_timer.h"
 #include "../log/log.h"
+#include "../log/access_log.h"
+#include "../log/trace_filter.h"
+#include "../cache/user_cache.h"
+#include "../cache/user_flight.h"
+#include "../cache/session_cache.h"
+
+// MariaDB客户端提供非阻塞查询接口（mysql_real_query_start/_cont），MySQL官方客户端没有，
+// 只有编译时检测到该接口才支持把数据库查询挂到epoll上异步完成
+#ifdef MYSQL_WAIT_READ
+#define SQL_ASYNC_SUPPORTED
+#endif
+
+// 一次异步插入的状态，和http连接分开存放，连接在查询结束前被关闭时查询仍能做完
+struct sql_async;
 
 class http_conn
 {
@@ -65,7 +80,10 @@ public:
         FORBIDDEN_REQUEST, // 请求资源禁止访问，没有读取权限
         FILE_REQUEST,      // 请求资源可以正常访问
         INTERNAL_ERROR,    // 服务器内部错误，该结果在主状态机switch的default下，一般不会触发
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        DB_REQUEST,        // 请求需要访问数据库（登录、注册），解析完后转交数据库线程池处理
+        ASYNC_REQUEST,     // 数据库查询已异步发出，连接挂起，等数据库socket就绪后由主线程继续处理
+        SERVICE_UNAVAILABLE // 等不到数据库连接，返回503
     };
     // 从状态机状态
     enum LINE_STATUS
@@ -86,6 +104,8 @@ public:
     //在工作线程或者主线程将数据读入缓冲区之后调用的处理函数，作用包括调用process_read,process_write
     //即从读缓冲区中读出http请求并处理，然后将响应报文写入写缓冲区中，然后关闭连接
     void process();
+    //数据库线程池调用，处理process解析出的登录、注册请求并生成响应
+    void process_db();
     //将浏览器发送来的数据读入读缓冲区
     bool read_once();
     //将写缓冲区的数据写出去
@@ -94,13 +114,19 @@ public:
     {
         return &m_address;
     }
-    //将数据库存储的用户名密码复制到本地，存入map中（所有http连接共享的）
-    void initmysql_result(connection_pool* connPool);
+    //fd是否是在等待查询结果的数据库socket
+    static bool sql_waiting(int fd);
+    //主线程在数据库socket就绪时调用，继续异步查询，完成后生成响应
+    static void sql_event(int fd, uint32_t events);
+    //客户连接关闭时调用，连接上还有没结束的异步查询时让查询和连接脱钩，查询结束后只归还数据库连接
+    static void abandon_sql(int sockfd);
 
     //标识工作线程是否将数据成功读入读缓冲区或是否成功从写缓冲区写出,
     //读或写了的话improv置为1（不管成不成功）（这样reactor模式主线程就能知道工作线程读没读写没写），失败的话timer_flag为1
     int timer_flag;
     int improv;
+    //0表示普通请求，1表示解析完成等待交给数据库线程池，2表示正在数据库线程池中处理
+    int db_flag;
 private:
     //初始化该http资源
     void init();
@@ -108,6 +134,8 @@ private:
     HTTP_CODE process_read();
     //根据处理得到的HTTP请求写报文
     bool process_write(HTTP_CODE ret);
+    //写报文并注册EPOLLOUT，写失败则关闭连接
+    void process_reply(HTTP_CODE ret);
 
     //下面6个函数由process_read()调用用以分析HTTP请求
     //主状态机解析报文中的请求行数据
@@ -118,13 +146,23 @@ private:
     HTTP_CODE parse_content(char *text);
     //分析HTTP请求是注册、登录或者请求什么资源
     HTTP_CODE do_request();
+    //查找用户，缓存未命中时查数据库并回填；snapshot不为空时记下结果是否来自可能过时的快照
+    USER_LOOKUP load_user(const char *name, string &passwd, bool *snapshot = nullptr);
+    //跳过缓存直接查数据库并回填缓存
+    USER_LOOKUP query_user(const char *name, string &passwd);
+    //异步执行注册的插入语句，返回1表示已挂起等待，0表示已同步完成，-1表示没能发起
+    int async_insert(const char *name, const char *password);
+    //异步插入结束，归还连接，更新用户表并设置跳转页面
+    void end_async_insert(int err);
     //m_start_line是行在buffer中的起始位置，将该位置后面的数据赋给text
     //此时从状态机已提前将一行的末尾字符/r/n变为/0/0，所以text可以直接取出完整的行进行解析
     char *get_line() { return m_read_buf + m_start_line; };
     //从状态机读取一行，分析是请求报文的哪一部分
     LINE_STATUS parse_line();
+    //响应写完后按采样率写一条访问日志
+    void log_access();
 
-    //下面9个函数process_write调用，根据相应的HTTP请求，对照响应报文格式，生成对应部分，
+    //下面10个函数process_write调用，根据相应的HTTP请求，对照响应报文格式，生成对应部分，
     //由process_write调用,通过add_response(const char* format, ...)添加到报文中
     void unmap();    
     bool add_response(const char *format, ...);
@@ -134,14 +172,19 @@ private:
     bool add_content_type();
     bool add_content_length(int content_length);
     bool add_linger();
+    bool add_date();
     bool add_blank_line();
 public:
     //静态变量epoll描述符
     static int m_epollfd;
     //静态变量，当前存在的连接数量
     static int m_user_count;
-    //数据库连接
-    MYSQL *mysql;
+    //数据库连接池，只在需要查询数据库时取连接，用完立即归还
+    static connection_pool *m_connPool;
+    //用户表存储，登录查询和注册插入都通过它
+    static user_store *m_store;
+    //是否把注册的插入语句挂到epoll上异步执行
+    static int m_sql_async;
     int m_state;  //读事件为0, 写事件为1
 private:
     // 连接套接字描述符
@@ -175,6 +218,18 @@ private:
     char *m_host;                   // 主机名
     int m_content_length;           // HTTP请求的消息体长度
     bool m_linger;                  // 是否是长连接
+    char m_cookie[SESSION_TOKEN_LEN + 1];      // 请求带的会话令牌，没有时为空串
+    char m_new_session[SESSION_TOKEN_LEN + 1]; // 本次登录新建的会话令牌，不为空时响应里设置cookie
+    char m_path[FILENAME_LEN];      // 请求行里的原始路径，m_url在处理时会被改写，访问日志用这份
+    char *m_referer;                // Referer头
+    char *m_agent;                  // User-Agent头
+
+    // 访问日志用的各阶段时间点（单调时钟微秒）和响应信息
+    long long m_start_us;   // 收到请求的第一个字节
+    long long m_parsed_us;  // 请求解析完，开始处理
+    long long m_replied_us; // 响应报文生成
+    int m_status;           // 响应状态码
+    long long m_body_len;   // 响应消息体长度
 
     char *m_file_address;    // 客户请求的目标文件被mmap到内存中的起始位置
     struct stat m_file_stat; // 目标文件的状态，通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小信息
@@ -189,6 +244,12 @@ private:
     map<string, string> m_users; // 没用上，本来可能想用来存储从数据库读的用户名密码
     int m_TRIGMode;              // 触发组合模式
     int m_close_log;             // 是否关闭日志
+    bool m_trace;                // 当前请求是否输出跟踪细节
+    bool m_trace_conn;           // 连接本身是否匹配跟踪规则（按地址和fd）
+    int m_trace_gen;             // m_trace_conn对应的规则版本号
+
+    sql_async *m_async;          // 正在执行的异步插入，没有时为nullptr
+    unsigned m_sql_gen;          // 请求转交数据库线程池时fd的关闭次数
 
     char sql_user[100];   // 登陆数据库用户名
     char sql_passwd[100]; // 登陆数据库密码
@@ -93,6 +93,44 @@ private:
     pthread_mutex_t m_mutex;    
 };
 
+//读写锁，读多写少时读者之间不互斥
+class rwlocker
+{
+public:
+    rwlocker()
+    {
+        if(pthread_rwlock_init(&m_rwlock, nullptr) != 0)
+        {
+            throw std::exception();
+        }
+    }
+
+    ~rwlocker()
+    {
+        pthread_rwlock_destroy(&m_rwlock);
+    }
+
+    //加读锁
+    bool rdlock()
+    {
+        return pthread_rwlock_rdlock(&m_rwlock) == 0;
+    }
+
+    //加写锁
+    bool wrlock()
+    {
+        return pthread_rwlock_wrlock(&m_rwlock) == 0;
+    }
+
+    //解锁
+    bool unlock()
+    {
+        return pthread_rwlock_unlock(&m_rwlock) == 0;
+    }
+private:
+    pthread_rwlock_t m_rwlock;
+};
+
 //条件变量， 注意要搭配互斥锁一起使用，防止  多个线程使用同一个资源
 class cond
 {
@@ -121,6 +159,7 @@ public:
     {
         int ret = 0;
         ret = pthread_cond_wait(&m_cond, m_mutex);
+        return ret == 0;
     }
 
     //超时等待
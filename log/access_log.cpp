@@ -0,0 +1,188 @@
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "access_log.h"
+#include "../timer/clock_cache.h"
+
+access_log::access_log()
+{
+    m_enabled = false;
+    memset(m_threshold, 0, sizeof(m_threshold));
+    memset(m_always, 0, sizeof(m_always));
+    m_fp = nullptr;
+    m_queue = nullptr;
+    m_stop = false;
+    m_written = 0;
+    m_dropped = 0;
+}
+
+access_log::~access_log()
+{
+    // 后台线程把队列里剩下的写完再退出
+    if (m_enabled)
+    {
+        __atomic_store_n(&m_stop, true, __ATOMIC_RELEASE);
+        // 放一条空记录唤醒后台线程，队列满时它本来就醒着
+        m_queue->push(string());
+        pthread_join(m_tid, nullptr);
+        fclose(m_fp);
+    }
+    delete m_queue;
+}
+
+access_log *access_log::GetInstance()
+{
+    static access_log log;
+    return &log;
+}
+
+long long access_log::now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+bool access_log::init(const char *file_name, const char *rates, int max_queue_size)
+{
+    // 依次是2xx、3xx、4xx、5xx的百分比
+    const char *p = rates;
+    bool any = false;
+    for (int cls = 2; cls <= 5; ++cls)
+    {
+        char *end;
+        double rate = strtod(p, &end);
+        if (end == p)
+            rate = 0;
+        if (rate < 0)
+            rate = 0;
+        m_always[cls] = rate >= 100;
+        m_threshold[cls] = m_always[cls] ? UINT32_MAX : (uint32_t)(rate / 100 * 4294967296.0);
+        any = any || rate > 0;
+        p = *end == ',' ? end + 1 : end;
+    }
+    m_always[1] = m_always[2];
+    m_threshold[1] = m_threshold[2];
+    if (!any)
+        return true;
+
+    m_fp = fopen(file_name, "a");
+    if (m_fp == nullptr)
+        return false;
+    m_queue = new mpsc_queue<string>(max_queue_size);
+    if (pthread_create(&m_tid, nullptr, worker, nullptr) != 0)
+    {
+        fclose(m_fp);
+        return false;
+    }
+    m_enabled = true;
+    return true;
+}
+
+bool access_log::sample(int status)
+{
+    int cls = status / 100;
+    if (!m_enabled || cls < 1 || cls > 5)
+        return false;
+    if (m_always[cls])
+        return true;
+    // 每个线程自己的xorshift随机数，不用加锁
+    static thread_local uint64_t seed = 0;
+    if (seed == 0)
+        seed = (uint64_t)now_us() * 0x9E3779B97F4A7C15ULL ^ (uint64_t)(uintptr_t)&seed;
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (uint32_t)(seed >> 32) < m_threshold[cls];
+}
+
+// 把s追加到buf，引号、反斜杠和控制字符转义，防止伪造日志行
+static int append_escaped(char *buf, int pos, int size, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    if (s == nullptr || *s == '\0')
+        s = "-";
+    for (; *s && pos < size - 4; ++s)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+        {
+            buf[pos++] = '\\';
+            buf[pos++] = c;
+        }
+        else if (c < 0x20 || c == 0x7f)
+        {
+            buf[pos++] = '\\';
+            buf[pos++] = 'x';
+            buf[pos++] = hex[c >> 4];
+            buf[pos++] = hex[c & 15];
+        }
+        else
+        {
+            buf[pos++] = c;
+        }
+    }
+    return pos;
+}
+
+void access_log::write(const access_entry &entry)
+{
+    char line[ACCESS_LINE_SIZE];
+    char client[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &entry.addr, client, sizeof(client));
+
+    clock_text now;
+    clock_cache::text(now);
+
+    // combined格式：客户端 - - [时间] "请求行" 状态码 字节数 "Referer" "User-Agent"
+    // 可变长的字段最多写到limit，后面固定长度的部分总能放下
+    int limit = sizeof(line) - 256;
+    int pos = snprintf(line, sizeof(line), "%s - - [%s] \"%s ", client, now.access, entry.method);
+    pos = append_escaped(line, pos, limit, entry.path);
+    pos += snprintf(line + pos, sizeof(line) - pos, " %s\" %d ", entry.version ? entry.version : "-", entry.status);
+    if (entry.bytes > 0)
+        pos += snprintf(line + pos, sizeof(line) - pos, "%lld \"", entry.bytes);
+    else
+        pos += snprintf(line + pos, sizeof(line) - pos, "- \"");
+    pos = append_escaped(line, pos, limit, entry.referer);
+    pos += snprintf(line + pos, sizeof(line) - pos, "\" \"");
+    pos = append_escaped(line, pos, limit, entry.agent);
+    pos += snprintf(line + pos, sizeof(line) - pos, "\" recv=%lldus handle=%lldus send=%lldus total=%lldus\n",
+                    entry.recv_us, entry.handle_us, entry.send_us, entry.total_us);
+
+    if (!m_queue->push(string(line, pos)))
+        __atomic_fetch_add(&m_dropped, 1, __ATOMIC_RELAXED);
+}
+
+void *access_log::worker(void *)
+{
+    access_log::GetInstance()->run();
+    return nullptr;
+}
+
+void access_log::run()
+{
+    string lines[ACCESS_BATCH];
+    while (true)
+    {
+        // 超时返回是为了检查退出标志
+        int n = m_queue->pop_batch(lines, ACCESS_BATCH, 1000);
+        // 只算真正交给文件的行，写失败（如磁盘满）的不算
+        long long written = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            if (fwrite(lines[i].data(), 1, lines[i].size(), m_fp) == lines[i].size())
+                ++written;
+        }
+        if (written > 0)
+            __atomic_fetch_add(&m_written, written, __ATOMIC_RELAXED);
+        if (n > 0 && !m_queue->empty())
+            continue;
+        // 队列已空，退出时不会再有新记录
+        if (__atomic_load_n(&m_stop, __ATOMIC_ACQUIRE))
+            break;
+        fflush(m_fp);
+    }
+    fflush(m_fp);
+}
@@ -0,0 +1,76 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "mpsc_queue.h"
+
+using namespace std;
+
+const int ACCESS_LINE_SIZE = 1024; // 一条访问日志的最大长度，超出的部分截断
+const int ACCESS_BATCH = 64;       // 后台线程每次从队列取出的最多行数
+
+// 一次请求结束时的原始字段，由连接在写完响应后填好
+struct access_entry
+{
+    struct in_addr addr;  // 客户端地址
+    const char *method;   // 请求方法
+    const char *path;     // 请求路径
+    const char *version;  // 协议版本
+    const char *referer;  // Referer头，没有时为nullptr
+    const char *agent;    // User-Agent头，没有时为nullptr
+    int status;           // 响应状态码
+    long long bytes;      // 响应消息体字节数
+    long long recv_us;    // 从收到第一个字节到请求解析完
+    long long handle_us;  // 处理请求（含数据库）到响应生成
+    long long send_us;    // 响应写完用的时间
+    long long total_us;   // 整个请求用的时间
+};
+
+// 访问日志，每个完成的请求一行，Apache combined格式后面加上各阶段耗时
+// 按状态码类别采样，调用线程只在采中时格式化，格式化好的行放进队列由后台线程写文件；队列满时丢弃，不拖慢请求
+class access_log
+{
+public:
+    // 单例模式
+    static access_log *GetInstance();
+
+    // rates为2xx、3xx、4xx、5xx的采样百分比，逗号分隔，如"1,10,100,100"，1xx按2xx算；全为0时不写访问日志
+    bool init(const char *file_name, const char *rates, int max_queue_size);
+    // 是否写访问日志
+    bool enabled() { return m_enabled; }
+    // 这个状态码的请求是否被采中
+    bool sample(int status);
+    // 格式化一条记录并交给后台线程
+    void write(const access_entry &entry);
+
+    // 后台线程写进文件和因队列满而丢弃的记录数
+    long long written() { return __atomic_load_n(&m_written, __ATOMIC_RELAXED); }
+    long long dropped() { return __atomic_load_n(&m_dropped, __ATOMIC_RELAXED); }
+
+    // 单调时钟（微秒），各阶段的时间点都用它记
+    static long long now_us();
+
+private:
+    access_log();
+    ~access_log();
+
+    static void *worker(void *arg);
+    // 后台线程：从队列成批取出记录写文件，队列空了再刷盘
+    void run();
+
+private:
+    bool m_enabled;
+    uint32_t m_threshold[6];  // 各状态码类别的采样阈值，随机数小于它时采中
+    bool m_always[6];         // 采样率为100%的类别
+    FILE *m_fp;
+    mpsc_queue<string> *m_queue;
+    pthread_t m_tid;
+    bool m_stop;
+    long long m_written;
+    long long m_dropped;
+};
+#endif
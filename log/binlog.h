@@ -0,0 +1,119 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// 二进制日志格式，日志类和离线解码工具log_decoder共用
+// 文件开头是binlog_header，之后是一条条记录，每条记录以binlog_record开头，按字节紧密排列，读取时要memcpy
+// site为0的记录是调用点定义：uint32 id，格式串'\0'，参数类型串'\0'；同一个id可能重复定义，内容相同
+// site不为0的记录是一次日志：int64 单调时钟纳秒，然后按调用点的参数类型依次存放参数
+// 参数类型：'i'为4字节int，'l'为8字节整数（long、long long、size_t、指针），'d'为double，'s'为uint16长度加字符串内容（不含'\0'）
+// 格式串里有不支持的转换说明时，调用点按"%s"定义，日志在写入时就格式化好，作为一个字符串参数存放
+
+const char BINLOG_MAGIC[8] = {'T', 'W', 'S', 'B', 'L', 'O', 'G', '\0'};
+const uint32_t BINLOG_VERSION = 1;
+const uint32_t BINLOG_TEXT_SITE = 1; // 预先格式化的日志共用的调用点，格式为"%s"
+
+struct binlog_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    int64_t real_ns; // 文件打开时的墙上时间
+    int64_t mono_ns; // 同一时刻的单调时钟，解码时据此把记录的单调时间换算成墙上时间
+};
+
+struct binlog_record
+{
+    uint16_t size; // 整条记录的字节数
+    uint8_t level; // 日志级别，调用点定义为0
+    uint8_t reserved;
+    uint32_t site; // 调用点id，0表示这是一条调用点定义
+};
+
+// 解析一个转换说明，p指向'%'后面的字符，把它消耗的参数类型追加到types（'*'宽度和精度各消耗一个int）
+// 返回转换说明之后的位置，不支持的转换（%n、%ls、long double等）返回nullptr
+static inline const char *binlog_parse_spec(const char *p, std::string &types)
+{
+    p += strspn(p, "-+ #0'");
+    if (*p == '*')
+    {
+        types += 'i';
+        ++p;
+    }
+    else
+        p += strspn(p, "0123456789");
+    if (*p == '.')
+    {
+        ++p;
+        if (*p == '*')
+        {
+            types += 'i';
+            ++p;
+        }
+        else
+            p += strspn(p, "0123456789");
+    }
+
+    bool wide = false;
+    for (; *p && strchr("hlqjzt", *p); ++p)
+    {
+        if (*p != 'h')
+            wide = true;
+    }
+    switch (*p)
+    {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        types += wide ? 'l' : 'i';
+        break;
+    case 'c':
+        if (wide)
+            return nullptr;
+        types += 'i';
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        types += 'd';
+        break;
+    case 's':
+        if (wide)
+            return nullptr;
+        types += 's';
+        break;
+    case 'p':
+        types += 'l';
+        break;
+    case '%':
+        break;
+    default:
+        return nullptr;
+    }
+    return p + 1;
+}
+
+// 解析整个格式串得到参数类型串，有不支持的转换时返回false
+static inline bool binlog_parse_format(const char *format, std::string &types)
+{
+    types.clear();
+    for (const char *p = strchr(format, '%'); p; p = strchr(p, '%'))
+    {
+        p = binlog_parse_spec(p + 1, types);
+        if (!p)
+            return false;
+    }
+    return true;
+}
+#endif
@@ -188,16 +188,17 @@ public:
     bool pop(T &item, int ms_timeout)
     {
         // ns精度
-        struct timespec t = {0, 0}; // 这里应该也用timeval才跟下面对的上
+        struct timespec t = {0, 0};
         // us精读
         struct timeval now = {0, 0};
         gettimeofday(&now, NULL);
         m_mutex.lock();
         if (m_size <= 0)
         {
-            // ms_timeout（ms精度）
-            t.tv_sec = now.tv_sec + ms_timeout / 1000; // 秒
-            t.tv_nsec = (ms_timeout % 1000) * 1000;    // 纳秒
+            // 截止时间是当前时间加上ms_timeout
+            long long usec = now.tv_usec + (long long)ms_timeout * 1000;
+            t.tv_sec = now.tv_sec + usec / 1000000; // 秒
+            t.tv_nsec = usec % 1000000 * 1000;      // 纳秒
             // 超时等待
             if (!m_cond.timewait(m_mutex.get(), t))
             {
@@ -1,44 +1,186 @@
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <vector>
+#include <algorithm>
 #include <stdarg.h>
 #include "log.h"
+#include "../timer/clock_cache.h"
 #include <pthread.h>
 using namespace std;
 
+// 线程退出时归还暂存区，暂存区里还没写出的内容由后台线程照常写出
+struct log_stage_holder
+{
+    log_stage *stage;
+    log_stage_holder() : stage(nullptr) {}
+    ~log_stage_holder()
+    {
+        if (stage)
+            __atomic_store_n(&stage->owned, false, __ATOMIC_RELEASE);
+    }
+};
+static thread_local log_stage_holder t_stage;
+
+int Log::m_level = LOG_LEVEL_DEBUG;
+
+int Log::set_level(int level)
+{
+    if (level < LOG_LEVEL_DEBUG)
+        level = LOG_LEVEL_DEBUG;
+    if (level > LOG_LEVEL_ERROR)
+        level = LOG_LEVEL_ERROR;
+    __atomic_store_n(&m_level, level, __ATOMIC_RELAXED);
+    return level;
+}
+
 Log::Log()
 {
     //初始化行数为0， 同步写入方式
     m_count = 0;
     m_is_async = false;
+    m_file_buf = nullptr;
+    m_fp = nullptr;
+    m_flush_interval = LOG_FLUSH_INTERVAL_MS;
+    m_last_flush = 0;
+    m_stages = nullptr;
+    m_wakeup = false;
+    m_space_waiters = 0;
+    m_stop = false;
+    m_overflow = LOG_OVERFLOW_BLOCK;
+    memset(m_dropped, 0, sizeof(m_dropped));
+    memset(m_reported, 0, sizeof(m_reported));
+    m_drop_seen = 0;
+    m_rotate_pending = false;
+    m_segment = 0;
+    m_file_name[0] = '\0';
+    m_compress_started = false;
+    m_compress_stop = false;
+    m_keep_files = 0;
+    m_keep_bytes = 0;
+    m_binary = false;
+    memset(m_sites, 0, sizeof(m_sites));
+    m_site_count = 0;
+    m_anchor_real = 0;
+    m_anchor_mono = 0;
+    m_day_end = 0;
 }
 
 Log::~Log()
 {
+    //让后台线程把暂存区写完再退出
+    if (m_is_async)
+    {
+        m_wake_lock.lock();
+        m_stop = true;
+        m_wake_cond.signal();
+        m_space_cond.broadcast();
+        m_wake_lock.unlock();
+        pthread_join(m_tid, nullptr);
+    }
+    //压缩到一半的文件留到下次启动时再压缩
+    if (m_compress_started)
+    {
+        m_compress_lock.lock();
+        m_compress_stop = true;
+        m_compress_cond.signal();
+        m_compress_lock.unlock();
+        pthread_join(m_compress_tid, nullptr);
+    }
     //关闭日志文件
     if(m_fp != nullptr)
     {
         fclose(m_fp);
     }
+    delete[] m_file_buf;
 }
 
-//如果为异步写入方式，需要设置阻塞队列的长度，同步则不需要设置
-bool Log::init(const char* file_name, int close_log, int log_buf_size, int split_lines, int max_queue_size)
+static long long now_ms()
 {
-    if(max_queue_size >= 1)
-    {   
-        //设置写入方式为异步
-        m_is_async = true;
-        //初始化阻塞队列
-        m_log_queue = new block_queue<string>(max_queue_size);
+    struct timeval now = {0, 0};
+    gettimeofday(&now, nullptr);
+    return now.tv_sec * 1000LL + now.tv_usec / 1000;
+}
 
-        pthread_t tid;
-        //创建一个新线程来运行flush_log_thread，用来异步写入日志
-        pthread_create(&tid, nullptr, flush_log_thread, nullptr);
+static const char *level_tag(int level)
+{
+    switch (level)
+    {
+    case 0:
+        return "[debug]:";
+    case 2:
+        return "[warn]:";
+    case 3:
+        return "[erro]:";
+    default:
+        return "[info]:";
     }
+}
+
+static int64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 把一条调用点定义追加到out
+static void encode_site(string &out, uint32_t id, const char *format, const string &types)
+{
+    binlog_record rec;
+    rec.size = sizeof(rec) + sizeof(id) + strlen(format) + 1 + types.size() + 1;
+    rec.level = 0;
+    rec.reserved = 0;
+    rec.site = 0;
+    out.append((const char *)&rec, sizeof(rec));
+    out.append((const char *)&id, sizeof(id));
+    out.append(format, strlen(format) + 1);
+    out.append(types.c_str(), types.size() + 1);
+}
+
+//max_queue_size大于0时为异步写入方式
+bool Log::init(const char* file_name, int close_log, int log_buf_size, int split_lines, int max_queue_size, bool binary, int overflow,
+               int keep_files, long long keep_bytes, int flush_interval_ms)
+{
+    m_overflow = overflow;
+    m_keep_files = keep_files;
+    m_keep_bytes = keep_bytes;
+    //间隔为0时后台线程会空转，用默认间隔
+    m_flush_interval = flush_interval_ms > 0 ? flush_interval_ms : LOG_FLUSH_INTERVAL_MS;
+    m_last_flush = now_ms();
 
     m_close_log = close_log;
 
+    //二进制模式只能异步写，一条记录的长度用16位表示
+    m_binary = binary;
+    if (m_binary)
+    {
+        if (max_queue_size < 1)
+            max_queue_size = 1;
+        if (log_buf_size > 65535)
+            log_buf_size = 65535;
+        m_anchor_real = clock_ns(CLOCK_REALTIME);
+        m_anchor_mono = clock_ns(CLOCK_MONOTONIC);
+        //预先格式化的日志共用的调用点
+        log_site *text = new log_site;
+        text->types = "s";
+        text->fixed = 2;
+        text->text = true;
+        m_sites[BINLOG_TEXT_SITE] = text;
+        m_site_count = BINLOG_TEXT_SITE;
+        encode_site(m_site_defs, BINLOG_TEXT_SITE, "%s", text->types);
+    }
+
     //输出缓冲区的长度
     m_log_buf_size = log_buf_size;
     //开辟缓冲区
@@ -49,8 +191,8 @@ bool Log::init(const char* file_name, int close_log, int log_buf_size, int split
     m_split_lines = split_lines;
 
     time_t t = time(nullptr);
-    struct tm* sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
+    struct tm my_tm;
+    localtime_r(&t, &my_tm);
 
     //从后往前找到第一个/的位置, 为了把日志名跟目录分开
     const char* p = strrchr(file_name, '/');
@@ -71,6 +213,7 @@ bool Log::init(const char* file_name, int close_log, int log_buf_size, int split
     }
 
     m_today = my_tm.tm_mday;
+    update_day_end(my_tm);
 
     //当mode是“a”时，表示“打开文件，用于追加 (在文件尾写)。如果文件不存在就创建它。流被定位于文件的末尾”。
     m_fp = fopen(log_full_name, "a");
@@ -78,124 +221,848 @@ bool Log::init(const char* file_name, int close_log, int log_buf_size, int split
     {
         return false;
     }
+    strcpy(m_file_name, log_full_name);
+    //全缓冲，缓冲区写满才写一次文件，不再每行一次write
+    m_file_buf = new char[LOG_FILE_BUF_SIZE];
+    setvbuf(m_fp, m_file_buf, _IOFBF, LOG_FILE_BUF_SIZE);
+    if (m_binary)
+        write_header();
+
+    if(max_queue_size >= 1)
+    {
+        //设置写入方式为异步
+        m_is_async = true;
+        //文件打开后再创建一个新线程来运行flush_log_thread，用来异步写入日志
+        pthread_create(&m_tid, nullptr, flush_log_thread, nullptr);
+    }
+    m_compress_started = pthread_create(&m_compress_tid, nullptr, compress_log_thread, nullptr) == 0;
 
     return true;
 }
 
-void Log::write_log(int level, const char* format, ...)
+void Log::rotate(const struct tm &my_tm)
+{
+    //如果上次写日志不是今天或者日志已经满行，则开一个新的
+    //别的线程可能已经换过了，持锁后再判断一次；异步写时行数在后台线程换文件前可能又涨了一些，按切分次数判断
+    long long count = __atomic_load_n(&m_count, __ATOMIC_RELAXED);
+    bool new_day = m_today != my_tm.tm_mday;
+    if (!new_day && count / m_split_lines <= m_segment)
+        return;
+
+    char new_log[256] = {0};
+    char tail[16] = {0};
+
+    //格式化时间部分
+    snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
+
+    //如果日志是新的时间，创建今天的日志
+    if (new_day)
+    {
+        snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
+    }
+    else
+    {
+        //如果是超过了最大行，则在之前日志名的基础上加上后缀m_count/m_split_lines表示是今天的第几篇日志
+        snprintf(new_log, 255, "%s%s%s.%lld", dir_name, tail, log_name, count / m_split_lines);
+    }
+
+    //先打开新文件，打不开时继续用旧文件
+    FILE *fp = fopen(new_log, "a");
+    if (fp == nullptr)
+        return;
+    if (new_day)
+    {
+        __atomic_store_n(&m_today, my_tm.tm_mday, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_count, 0, __ATOMIC_RELAXED);
+        m_segment = 0;
+    }
+    else
+    {
+        m_segment = count / m_split_lines;
+    }
+
+    //旧文件写空后换成新文件，旧文件交给压缩线程
+    //fflush()会强迫将缓冲区内的数据写回参数stream 指定的文件中
+    fflush(m_fp);
+    fclose(m_fp);
+    m_fp = fp;
+    setvbuf(m_fp, m_file_buf, _IOFBF, LOG_FILE_BUF_SIZE);
+    update_day_end(my_tm);
+    //二进制日志每个文件都带上全部调用点定义，单独拿出一个文件也能解码
+    if (m_binary)
+        write_header();
+
+    if (m_compress_started && strcmp(m_file_name, new_log) != 0)
+    {
+        m_compress_lock.lock();
+        m_compress_queue.push_back(m_file_name);
+        m_compress_cond.signal();
+        m_compress_lock.unlock();
+    }
+    strcpy(m_file_name, new_log);
+}
+
+void Log::request_rotate()
 {
-    //获取时间
+    //先读一次，已经有线程要求过时不用抢
+    if (__atomic_load_n(&m_rotate_pending, __ATOMIC_RELAXED))
+        return;
+    bool expected = false;
+    if (__atomic_compare_exchange_n(&m_rotate_pending, &expected, true, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        wakeup();
+}
+
+void Log::update_day_end(const struct tm &my_tm)
+{
+    struct tm next = my_tm;
+    next.tm_mday += 1;
+    next.tm_hour = 0;
+    next.tm_min = 0;
+    next.tm_sec = 0;
+    next.tm_isdst = -1;
+    __atomic_store_n(&m_day_end, mktime(&next), __ATOMIC_RELAXED);
+}
+
+void Log::write_header()
+{
+    binlog_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINLOG_MAGIC, sizeof(header.magic));
+    header.version = BINLOG_VERSION;
+    header.real_ns = clock_ns(CLOCK_REALTIME);
+    header.mono_ns = clock_ns(CLOCK_MONOTONIC);
+    fwrite(&header, sizeof(header), 1, m_fp);
+    fwrite(m_site_defs.data(), 1, m_site_defs.size(), m_fp);
+    //之后后台线程直接往文件描述符写，这里要先把stdio缓冲写空
+    fflush(m_fp);
+}
+
+void Log::write_log(int level, int *site, const char* format, ...)
+{
+    //将format后面的可变参数地址给valst，用于格式化输出
+    va_list valst;
+    va_start(valst, format);
+
+    if (m_binary)
+    {
+        write_binary(level, site, format, valst);
+        va_end(valst);
+        return;
+    }
+
+    //获取时间，年月日时分秒取时钟缓存里每秒格式化一次的字符串
     struct timeval now = {0,0};
     gettimeofday(&now, nullptr);
-    time_t t = now.tv_sec;
-    struct tm* sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
+    clock_text ct;
+    clock_cache::text(now.tv_sec, ct);
+    const struct tm &my_tm = ct.tm;
 
-    char s[16] = {0};
     //日志分级
-    switch (level)
+    const char *s = level_tag(level);
+
+    //更新行数，只有需要换文件时才加锁；异步写时交给后台线程换
+    long long count = __atomic_add_fetch(&m_count, 1, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&m_today, __ATOMIC_RELAXED) != my_tm.tm_mday || count % m_split_lines == 0)
     {
-    case 0:
-        strcpy(s, "[debug]:");
-        break;
-    case 1:
-        strcpy(s, "[info]:");
-        break;
-    case 2:
-        strcpy(s, "[warn]:");
+        if (m_is_async)
+        {
+            request_rotate();
+        }
+        else
+        {
+            m_mutex.lock();
+            rotate(my_tm);
+            m_mutex.unlock();
+        }
+    }
+
+    //异步时格式化到本线程自己的缓冲，同步时在锁内格式化到共享缓冲
+    log_stage *stage = m_is_async ? get_stage() : nullptr;
+    char *buf = m_buf;
+    if (stage)
+        buf = stage->line;
+    else
+        m_mutex.lock();
+
+    //写入内容格式：时间 + 内容
+    //时间格式化，snprintf成功返回写字符的总数，其中不包括结尾的null字符
+    //snprintf()，函数原型为int snprintf(char *str, size_t size, const char *format, ...)。
+    //将可变参数 “…” 按照format的格式格式化为字符串，然后再将其拷贝至str中。
+    int n = snprintf(buf, 48, "%s.%06ld %s ", ct.log, now.tv_usec, s);
+
+    //将格式化数据从可变参数列表写入缓冲区
+    //内容格式化，用于向字符串中打印数据、数据格式用户自定义，返回写入到字符数组str中的字符个数(不包含终止符)
+    //超长的内容被截断，留出换行符和结尾'\0'的位置
+    int m = vsnprintf(buf + n, m_log_buf_size - n - 1, format, valst);
+    if (m < 0)
+        m = 0;
+    if (m > m_log_buf_size - n - 2)
+        m = m_log_buf_size - n - 2;
+    buf[n + m] = '\n';
+    buf[n + m + 1] = '\0';
+
+    //若m_is_async为true表示异步，默认为同步
+    //若异步,则将日志追加到本线程的暂存区,同步则在锁内向文件中写
+    if (stage)
+    {
+        append(stage, buf, n + m + 1, level);
+    }
+    else
+    {
+        fputs(buf, m_fp);
+        flush_if_due(level);
+        m_mutex.unlock();
+    }
+
+    va_end(valst);
+}
+
+log_stage *Log::get_stage()
+{
+    if (t_stage.stage)
+        return t_stage.stage;
+
+    //先找一个退出的线程留下的暂存区
+    log_stage *stage = __atomic_load_n(&m_stages, __ATOMIC_ACQUIRE);
+    for (; stage; stage = stage->next)
+    {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&stage->owned, &expected, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!stage)
+    {
+        stage = new log_stage;
+        stage->data = new char[LOG_STAGE_SIZE];
+        stage->line = new char[m_log_buf_size];
+        stage->head = 0;
+        stage->tail = 0;
+        stage->sample = 0;
+        stage->owned = true;
+        //插入链表头部，后台线程从头部开始遍历，初始化完成后再发布
+        m_mutex.lock();
+        stage->next = m_stages;
+        __atomic_store_n(&m_stages, stage, __ATOMIC_RELEASE);
+        m_mutex.unlock();
+    }
+    t_stage.stage = stage;
+    return stage;
+}
+
+void Log::append(log_stage *stage, const char *line, int len, int level)
+{
+    //一行最长m_log_buf_size，暂存区放得下；空间不够时按策略丢弃，或者唤醒后台线程并等它写出
+    uint64_t head = stage->head;
+    uint64_t need = head + len - __atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE);
+    bool full = need > (uint64_t)LOG_STAGE_SIZE;
+    bool drop = false;
+    switch (m_overflow)
+    {
+    case LOG_OVERFLOW_DROP:
+        drop = full;
         break;
-    case 3:
-        strcpy(s, "[erro]:");
+    case LOG_OVERFLOW_LEVEL:
+        //ERROR往往在过载时（如数据库故障）成片出现，这时等后台线程只会让请求更慢，写满了也丢弃并计数
+        drop = full || (need > (uint64_t)LOG_STAGE_HIGH && level < LOG_LEVEL_WARN) ||
+               (need > (uint64_t)LOG_STAGE_ERROR && level < LOG_LEVEL_ERROR);
         break;
-    default:
-        strcpy(s, "[info]:");
+    case LOG_OVERFLOW_SAMPLE:
+        drop = full || (need > (uint64_t)LOG_STAGE_HIGH && ++stage->sample % LOG_SAMPLE_RATE != 0);
         break;
-    } 
+    }
+    if (drop)
+    {
+        //超过一半时已经唤醒过后台线程，这里只计数
+        int idx = level < LOG_LEVEL_DEBUG ? LOG_LEVEL_DEBUG : level > LOG_LEVEL_ERROR ? LOG_LEVEL_ERROR : level;
+        __atomic_fetch_add(&m_dropped[idx], 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (full)
+    {
+        m_wake_lock.lock();
+        ++m_space_waiters;
+        while (head + len - __atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE) > (uint64_t)LOG_STAGE_SIZE && !m_stop)
+        {
+            m_wakeup = true;
+            m_wake_cond.signal();
+            m_space_cond.wait(m_wake_lock.get());
+        }
+        --m_space_waiters;
+        m_wake_lock.unlock();
+        if (m_stop)
+            return;
+    }
 
-    //操作之前先上锁
-    m_mutex.lock();
+    size_t off = head & (LOG_STAGE_SIZE - 1);
+    size_t first = len < (int)(LOG_STAGE_SIZE - off) ? len : LOG_STAGE_SIZE - off;
+    memcpy(stage->data + off, line, first);
+    memcpy(stage->data, line + first, len - first);
+    //整行拷贝完才发布，后台线程只会看到完整的行
+    __atomic_store_n(&stage->head, head + len, __ATOMIC_RELEASE);
 
-    //更新行数
-    m_count++;
-    
-    //如果上次写日志不是今天或者日志已经满行，则开一个新的, 之所以是m_count % m_split_lines == 0，因为可能已经写满了多个日志文件
-    if(m_today != my_tm.tm_mday || m_count % m_split_lines == 0)
-    {
-        char new_log[256] = {0};
-        //fflush()会强迫将缓冲区内的数据写回参数stream 指定的文件中
-        //如果参数stream 为NULL，fflush()会将所有打开的文件数据更新。
-        fflush(m_fp);
-        //关闭旧的日志文件
-        fclose(m_fp);
-        char tail[16] = {0};
+    //ERROR日志立即写出；暂存区刚超过一半时提前唤醒后台线程，不用等到写满
+    uint64_t used = head + len - __atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE);
+    if (level >= LOG_FLUSH_LEVEL || (used > LOG_STAGE_SIZE / 2 && used - len <= LOG_STAGE_SIZE / 2))
+        wakeup();
+}
 
-        //格式化时间部分
-        snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
+int Log::register_site(int *site, const char *format)
+{
+    string types;
+    bool ok = binlog_parse_format(format, types);
+    size_t fixed = 0;
+    for (size_t i = 0; i < types.size(); ++i)
+        fixed += types[i] == 'i' ? 4 : types[i] == 's' ? 2 : 8;
 
-        //如果日志是新的时间，创建今天的日志
-        if(m_today != my_tm.tm_mday)
+    m_mutex.lock();
+    int id = __atomic_load_n(site, __ATOMIC_RELAXED);
+    if (id == 0)
+    {
+        //格式串不支持、参数太多或者调用点太多时，这个调用点写入时就格式化
+        if (!ok || sizeof(binlog_record) + sizeof(int64_t) + fixed > (size_t)m_log_buf_size || m_site_count + 1 >= LOG_MAX_SITES)
         {
-            snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
-            m_today = my_tm.tm_mday;
-            m_count = 0;
+            id = BINLOG_TEXT_SITE;
         }
         else
         {
-            //如果是超过了最大行，则在之前日志名的基础上加上后缀m_count/m_split_lines表示是今天的第几篇日志
-            snprintf(new_log, 255, "%s%s%s.%lld", dir_name, tail, log_name, m_count / m_split_lines);
+            id = ++m_site_count;
+            log_site *info = new log_site;
+            info->types = types;
+            info->fixed = fixed;
+            info->text = false;
+            m_sites[id] = info;
+
+            //定义直接写进文件，之后才发布id，文件里定义一定在这个调用点的记录前面
+            string def;
+            encode_site(def, id, format, types);
+            m_site_defs += def;
+            if (write(fileno(m_fp), def.data(), def.size()) < 0)
+                perror("write log site");
         }
+        __atomic_store_n(site, id, __ATOMIC_RELEASE);
+    }
+    m_mutex.unlock();
+    return id;
+}
+
+void Log::write_binary(int level, int *site, const char *format, va_list valst)
+{
+    int id = __atomic_load_n(site, __ATOMIC_ACQUIRE);
+    if (id == 0)
+        id = register_site(site, format);
+    const log_site *info = m_sites[id];
 
-        //创建新的日志文件
-        m_fp = fopen(new_log, "a");
+    //记录单调时钟，按初始化时的对应关系推算墙上时间，只用来判断是否到了第二天
+    int64_t mono = clock_ns(CLOCK_MONOTONIC);
+    time_t sec = (m_anchor_real + (mono - m_anchor_mono)) / 1000000000LL;
+    long long count = __atomic_add_fetch(&m_count, 1, __ATOMIC_RELAXED);
+    if (sec >= __atomic_load_n(&m_day_end, __ATOMIC_RELAXED) || count % m_split_lines == 0)
+        request_rotate();
+
+    log_stage *stage = get_stage();
+    char *buf = stage->line;
+    size_t cap = m_log_buf_size;
+    size_t pos = sizeof(binlog_record);
+    memcpy(buf + pos, &mono, sizeof(mono));
+    pos += sizeof(mono);
+
+    if (info->text)
+    {
+        //不支持的格式串在这里格式化，作为一个字符串参数
+        size_t room = cap - pos - sizeof(uint16_t);
+        int m = vsnprintf(buf + pos + sizeof(uint16_t), room, format, valst);
+        if (m < 0)
+            m = 0;
+        if ((size_t)m >= room)
+            m = room - 1;
+        uint16_t len = m;
+        memcpy(buf + pos, &len, sizeof(len));
+        pos += sizeof(len) + m;
+    }
+    else
+    {
+        //按登记时解析出的类型依次取出参数，字符串按剩余空间截断，给后面的参数留出位置
+        size_t fixed = info->fixed;
+        for (size_t i = 0; i < info->types.size(); ++i)
+        {
+            switch (info->types[i])
+            {
+            case 'i':
+            {
+                int v = va_arg(valst, int);
+                memcpy(buf + pos, &v, sizeof(v));
+                pos += sizeof(v);
+                fixed -= sizeof(v);
+                break;
+            }
+            case 'l':
+            {
+                long long v = va_arg(valst, long long);
+                memcpy(buf + pos, &v, sizeof(v));
+                pos += sizeof(v);
+                fixed -= sizeof(v);
+                break;
+            }
+            case 'd':
+            {
+                double v = va_arg(valst, double);
+                memcpy(buf + pos, &v, sizeof(v));
+                pos += sizeof(v);
+                fixed -= sizeof(v);
+                break;
+            }
+            case 's':
+            {
+                const char *v = va_arg(valst, const char *);
+                if (!v)
+                    v = "(null)";
+                fixed -= sizeof(uint16_t);
+                size_t room = cap - pos - sizeof(uint16_t) - fixed;
+                size_t n = strlen(v);
+                if (n > room)
+                    n = room;
+                uint16_t len = n;
+                memcpy(buf + pos, &len, sizeof(len));
+                memcpy(buf + pos + sizeof(len), v, n);
+                pos += sizeof(len) + n;
+                break;
+            }
+            }
+        }
     }
 
-    m_mutex.unlock();
+    binlog_record rec;
+    rec.size = pos;
+    rec.level = level;
+    rec.reserved = 0;
+    rec.site = info->text ? BINLOG_TEXT_SITE : id;
+    memcpy(buf, &rec, sizeof(rec));
+    append(stage, buf, pos, level);
+}
 
-    //将format后面的可变参数地址给valst，用于格式化输出
-    va_list valst;
-    va_start(valst, format);
+void Log::wakeup()
+{
+    m_wake_lock.lock();
+    m_wakeup = true;
+    m_wake_cond.signal();
+    m_wake_lock.unlock();
+}
+
+// 写满iov中的全部内容，部分写入时调整iov继续写，出错时放弃剩下的内容
+static void write_all(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0)
+    {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            ++iov;
+            --cnt;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+bool Log::drain()
+{
+    struct iovec iov[LOG_DRAIN_IOV];
+    log_stage *drained[LOG_DRAIN_IOV / 2];
+    uint64_t heads[LOG_DRAIN_IOV / 2];
+    int cnt = 0, stages = 0;
+    bool wrote = false;
 
-    string log_str;
     m_mutex.lock();
+    int fd = fileno(m_fp);
+    for (log_stage *stage = __atomic_load_n(&m_stages, __ATOMIC_ACQUIRE); ; stage = stage->next)
+    {
+        //凑满一批或者遍历完，写出并推进各暂存区的tail
+        if (!stage || stages == LOG_DRAIN_IOV / 2)
+        {
+            if (cnt > 0)
+            {
+                write_all(fd, iov, cnt);
+                for (int i = 0; i < stages; ++i)
+                    __atomic_store_n(&drained[i]->tail, heads[i], __ATOMIC_RELEASE);
+                wrote = true;
+            }
+            cnt = 0;
+            stages = 0;
+            if (!stage)
+                break;
+        }
 
-    //写入内容格式：时间 + 内容
-    //时间格式化，snprintf成功返回写字符的总数，其中不包括结尾的null字符
-    //snprintf()，函数原型为int snprintf(char *str, size_t size, const char *format, ...)。
-    //将可变参数 “…” 按照format的格式格式化为字符串，然后再将其拷贝至str中。
-    int n = snprintf(m_buf, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ",
-                     my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
-                     my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
-    
+        uint64_t head = __atomic_load_n(&stage->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = stage->tail;
+        if (head == tail)
+            continue;
+        size_t off = tail & (LOG_STAGE_SIZE - 1);
+        size_t len = head - tail;
+        size_t first = len < LOG_STAGE_SIZE - off ? len : LOG_STAGE_SIZE - off;
+        iov[cnt].iov_base = stage->data + off;
+        iov[cnt++].iov_len = first;
+        if (len > first)
+        {
+            iov[cnt].iov_base = stage->data;
+            iov[cnt++].iov_len = len - first;
+        }
+        drained[stages] = stage;
+        heads[stages++] = head;
+    }
+    if (wrote)
+        m_last_flush = now_ms();
+    m_mutex.unlock();
 
-    //将格式化数据从可变参数列表写入缓冲区
-    //内容格式化，用于向字符串中打印数据、数据格式用户自定义，返回写入到字符数组str中的字符个数(不包含终止符)    
-    int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
-    m_buf[n + m] = '\n';
-    m_buf[n + m + 1] = '\0';
+    //有线程在等暂存区空间
+    if (wrote)
+    {
+        m_wake_lock.lock();
+        if (m_space_waiters > 0)
+            m_space_cond.broadcast();
+        m_wake_lock.unlock();
+    }
+    return wrote;
+}
+
+void Log::async_write_log()
+{
+    while (true)
+    {
+        //等到有线程要求写出、退出或者到了刷盘间隔
+        m_wake_lock.lock();
+        if (!m_wakeup && !m_stop)
+        {
+            struct timeval now = {0, 0};
+            gettimeofday(&now, nullptr);
+            long long usec = now.tv_usec + (long long)m_flush_interval * 1000;
+            struct timespec t;
+            t.tv_sec = now.tv_sec + usec / 1000000;
+            t.tv_nsec = usec % 1000000 * 1000;
+            m_wake_cond.timewait(m_wake_lock.get(), t);
+        }
+        m_wakeup = false;
+        bool stop = m_stop;
+        m_wake_lock.unlock();
+
+        //一次唤醒把所有暂存区写空，压力过去后再记下这段时间丢弃的行数
+        while (drain())
+            ;
+        //要求换文件之前的内容都写进了旧文件，再换新文件
+        if (__atomic_load_n(&m_rotate_pending, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&m_rotate_pending, false, __ATOMIC_RELAXED);
+            clock_text ct;
+            clock_cache::text(time(nullptr), ct);
+            m_mutex.lock();
+            rotate(ct.tm);
+            m_mutex.unlock();
+        }
+        write_drop_summary(stop);
+        if (stop)
+            break;
+    }
+}
+
+void Log::write_drop_summary(bool force)
+{
+    long long now[4];
+    long long seen = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        now[i] = __atomic_load_n(&m_dropped[i], __ATOMIC_RELAXED);
+        seen += now[i];
+    }
+    //还在丢弃时只记下总数，持续过载时不会每轮都写一行
+    bool easing = seen == m_drop_seen;
+    m_drop_seen = seen;
+    if (!easing && !force)
+        return;
+
+    long long delta[4];
+    long long total = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        delta[i] = now[i] - m_reported[i];
+        m_reported[i] = now[i];
+        total += delta[i];
+    }
+    if (total == 0)
+        return;
 
-    log_str = m_buf;
+    char msg[256];
+    int n = snprintf(msg, sizeof(msg), "log overflow: dropped %lld lines (debug %lld, info %lld, warn %lld, error %lld)",
+                     total, delta[0], delta[1], delta[2], delta[3]);
+    //按当前格式直接写进文件，不经过暂存区
+    string out;
+    if (m_binary)
+    {
+        int64_t mono = clock_ns(CLOCK_MONOTONIC);
+        uint16_t len = n;
+        binlog_record rec;
+        rec.size = sizeof(rec) + sizeof(mono) + sizeof(len) + len;
+        rec.level = LOG_LEVEL_WARN;
+        rec.reserved = 0;
+        rec.site = BINLOG_TEXT_SITE;
+        out.append((const char *)&rec, sizeof(rec));
+        out.append((const char *)&mono, sizeof(mono));
+        out.append((const char *)&len, sizeof(len));
+        out.append(msg, n);
+    }
+    else
+    {
+        struct timeval now = {0, 0};
+        gettimeofday(&now, nullptr);
+        clock_text ct;
+        clock_cache::text(now.tv_sec, ct);
+        char prefix[48];
+        snprintf(prefix, sizeof(prefix), "%s.%06ld %s ", ct.log, now.tv_usec, level_tag(LOG_LEVEL_WARN));
+        out = prefix;
+        out.append(msg, n);
+        out += '\n';
+    }
+    m_mutex.lock();
+    if (write(fileno(m_fp), out.data(), out.size()) < 0)
+        perror("write log summary");
     m_mutex.unlock();
+}
 
-    //若m_is_async为true表示异步，默认为同步
-    //若异步,则将日志信息加入阻塞队列,同步则加锁向文件中写
-    if (m_is_async && !m_log_queue->full())
+void Log::compress_log()
+{
+    //压缩不急，降到最低优先级，不和请求线程抢CPU
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    scan_uncompressed();
+    enforce_retention();
+
+    while (true)
+    {
+        m_compress_lock.lock();
+        while (m_compress_queue.empty() && !m_compress_stop)
+            m_compress_cond.wait(m_compress_lock.get());
+        if (m_compress_stop)
+        {
+            m_compress_lock.unlock();
+            break;
+        }
+        string path = m_compress_queue.front();
+        m_compress_queue.pop_front();
+        m_compress_lock.unlock();
+
+        if (!compress_file(path))
+            break;
+        enforce_retention();
+    }
+}
+
+bool Log::compress_file(const string &path)
+{
+    FILE *in = fopen(path.c_str(), "rb");
+    if (in == nullptr)
+        return true;
+    //先写临时文件，压缩完再改名，中途退出不会留下不完整的.gz
+    string tmp = path + ".gz.tmp";
+    gzFile out = gzopen(tmp.c_str(), "wb");
+    if (out == nullptr)
+    {
+        fclose(in);
+        return true;
+    }
+
+    char buf[64 * 1024];
+    size_t n;
+    bool ok = true;
+    while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+    {
+        ok = gzwrite(out, buf, n) == (int)n;
+        if (__atomic_load_n(&m_compress_stop, __ATOMIC_RELAXED))
+        {
+            fclose(in);
+            gzclose(out);
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    ok = !ferror(in) && ok;
+    //压缩文件沿用原文件的修改时间，清理旧文件时按它排序
+    struct stat st;
+    ok = fstat(fileno(in), &st) == 0 && ok;
+    fclose(in);
+    ok = gzclose(out) == Z_OK && ok;
+    if (ok)
     {
-        m_log_queue->push(log_str);
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        utimensat(AT_FDCWD, tmp.c_str(), times, 0);
     }
+    if (ok && rename(tmp.c_str(), (path + ".gz").c_str()) == 0)
+        unlink(path.c_str());
     else
+        unlink(tmp.c_str());
+    return true;
+}
+
+// 日志目录，没有目录时为当前目录
+static string log_dir(const char *dir_name)
+{
+    return dir_name[0] ? dir_name : "./";
+}
+
+// 去掉目录部分的文件名
+static string base_name(const char *path)
+{
+    const char *p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
+
+// 是否是这个日志的文件：年_月_日_文件名，后面只能是.分段号、.gz或.分段号.gz
+// 不知道日志文件名时一个都不认，免得按日期前缀误删目录里别的文件
+static bool is_log_file(const char *name, const char *log_name)
+{
+    size_t len = strlen(log_name);
+    if (len == 0)
+        return false;
+    int y, m, d, n = 0;
+    if (sscanf(name, "%4d_%2d_%2d_%n", &y, &m, &d, &n) != 3 || n == 0)
+        return false;
+    if (strncmp(name + n, log_name, len) != 0)
+        return false;
+    const char *rest = name + n + len;
+    if (*rest == '.' && isdigit((unsigned char)rest[1]))
     {
-        m_mutex.lock();
-        fputs(log_str.c_str(), m_fp);
-        m_mutex.unlock();
+        ++rest;
+        while (isdigit((unsigned char)*rest))
+            ++rest;
     }
+    return *rest == '\0' || strcmp(rest, ".gz") == 0;
+}
 
-    va_end(valst);
+void Log::scan_uncompressed()
+{
+    string dir = log_dir(dir_name);
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr)
+        return;
+    m_mutex.lock();
+    string current = base_name(m_file_name);
+    m_mutex.unlock();
+    vector<string> found;
+    for (struct dirent *e = readdir(d); e; e = readdir(d))
+    {
+        size_t len = strlen(e->d_name);
+        if (!is_log_file(e->d_name, log_name) || current == e->d_name)
+            continue;
+        if (len > 3 && strcmp(e->d_name + len - 3, ".gz") == 0)
+            continue;
+        found.push_back(dir + e->d_name);
+    }
+    closedir(d);
+
+    m_compress_lock.lock();
+    for (size_t i = 0; i < found.size(); ++i)
+        m_compress_queue.push_back(found[i]);
+    m_compress_lock.unlock();
+}
+
+void Log::enforce_retention()
+{
+    if (m_keep_files <= 0 && m_keep_bytes <= 0)
+        return;
+
+    struct log_file
+    {
+        string name;
+        string path;
+        struct timespec mtime;
+        long long size;
+        bool operator<(const log_file &other) const
+        {
+            if (mtime.tv_sec != other.mtime.tv_sec)
+                return mtime.tv_sec < other.mtime.tv_sec;
+            return mtime.tv_nsec < other.mtime.tv_nsec;
+        }
+    };
+
+    string dir = log_dir(dir_name);
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr)
+        return;
+    vector<log_file> files;
+    long long total = 0;
+    for (struct dirent *e = readdir(d); e; e = readdir(d))
+    {
+        if (!is_log_file(e->d_name, log_name))
+            continue;
+        log_file f;
+        f.name = e->d_name;
+        f.path = dir + e->d_name;
+        struct stat st;
+        if (stat(f.path.c_str(), &st) != 0)
+            continue;
+        f.mtime = st.st_mtim;
+        f.size = st.st_size;
+        total += f.size;
+        files.push_back(f);
+    }
+    closedir(d);
+
+    //当前文件也算在内，但不会被删除
+    sort(files.begin(), files.end());
+    m_mutex.lock();
+    string current = base_name(m_file_name);
+    m_mutex.unlock();
+    long long count = files.size();
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if ((m_keep_files <= 0 || count <= m_keep_files) && (m_keep_bytes <= 0 || total <= m_keep_bytes))
+            break;
+        if (files[i].name == current)
+            continue;
+        if (unlink(files[i].path.c_str()) == 0)
+        {
+            --count;
+            total -= files[i].size;
+        }
+    }
 }
 
 void Log::flush(void)
 {
+    //异步时让后台线程立即写出暂存区
+    if (m_is_async)
+    {
+        wakeup();
+        return;
+    }
     m_mutex.lock();
     //强迫将缓冲区内的数据写回参数指定的文件中
     fflush(m_fp);
+    m_last_flush = now_ms();
+    m_mutex.unlock();
+}
+
+void Log::flush_idle(void)
+{
+    if (m_is_async || !m_fp)
+        return;
+    m_mutex.lock();
+    flush_if_due(-1);
     m_mutex.unlock();
-}
\ No newline at end of file
+}
+
+void Log::flush_if_due(int level)
+{
+    long long now = now_ms();
+    if (level >= LOG_FLUSH_LEVEL || now - m_last_flush >= m_flush_interval)
+    {
+        fflush(m_fp);
+        m_last_flush = now;
+    }
+}
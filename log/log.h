@@ -2,15 +2,71 @@
 #define LOG_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <iostream>
 #include <string>
+#include <deque>
 #include <stdarg.h>
 #include <pthread.h>
-#include "block_queue.h"
+#include <time.h>
+#include "../lock/locker.h"
+#include "binlog.h"
 
 using namespace std;
 
-// 使用条件变量和互斥锁实现消费者生产者模型，消费者消费者之间，消费者生产者之间，生产者生产者之间都是互斥关系
+const int LOG_FLUSH_INTERVAL_MS = 1000;  // 距上次刷盘超过这么久就刷一次
+const int LOG_FLUSH_LEVEL = 3;           // 不低于这个级别（ERROR）的日志写完立即刷盘
+const int LOG_FILE_BUF_SIZE = 64 * 1024; // 同步写时日志文件的stdio缓冲区，写满时自动写出
+const int LOG_STAGE_SIZE = 64 * 1024;    // 异步写时每个线程暂存区的大小，必须是2的幂
+const int LOG_DRAIN_IOV = 64;            // 后台线程一次writev最多的分块数
+const int LOG_MAX_SITES = 4096;          // 二进制日志最多的调用点数，超出的调用点写入时就格式化
+
+// 日志级别，要在#if里比较，所以用宏
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+// 异步写时暂存区放不下一行日志的处理方式
+#define LOG_OVERFLOW_BLOCK 0    // 等后台线程写出
+#define LOG_OVERFLOW_DROP 1     // 丢弃这一行
+#define LOG_OVERFLOW_LEVEL 2    // 超过高水位丢弃INFO及以下，超过ERROR水位再丢弃WARN，写满时ERROR也丢弃，都不等待
+#define LOG_OVERFLOW_SAMPLE 3   // 超过高水位每LOG_SAMPLE_RATE行保留一行，写满时丢弃
+
+const int LOG_STAGE_HIGH = LOG_STAGE_SIZE / 4 * 3; // 暂存区高水位
+const int LOG_STAGE_ERROR = LOG_STAGE_SIZE / 8 * 7; // 按级别丢弃时超过它只收ERROR，最后这一段留给ERROR
+const int LOG_SAMPLE_RATE = 16;                    // 采样策略下超过高水位时的保留比例
+
+// 编译期最低级别，低于它的LOG_*调用直接不编进程序，编译时用-DLOG_MIN_LEVEL=2之类的方式指定
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// 异步写日志时每个线程自己的暂存区，是一个单生产者单消费者的环形字节缓冲
+// 所属线程往里追加整行日志，不加锁；后台线程把所有线程暂存区里的内容用一次writev写出
+// 线程退出后暂存区不释放，留给之后新建的线程接着用
+struct log_stage
+{
+    char *data;      // 环形缓冲，LOG_STAGE_SIZE字节
+    char *line;      // 格式化一行日志用的缓冲，m_log_buf_size字节
+    uint64_t head;   // 所属线程写到的位置，只增不减
+    uint64_t tail;   // 后台线程写出到的位置，只增不减
+    unsigned sample; // 采样策略下超过高水位后的行数，只有所属线程访问
+    bool owned;      // 是否有线程在用
+    log_stage *next; // 所有暂存区串成链表，只在头部插入
+};
+
+// 二进制日志中一个调用点的参数信息
+struct log_site
+{
+    string types; // 参数类型串，见binlog.h
+    size_t fixed; // 参数至少占的字节数（字符串只算长度字段）
+    bool text;    // 是否写入时就格式化
+};
+
+// 同步写时所有线程在一把互斥锁下格式化并写入文件
+// 异步写时每个线程把日志格式化到自己的暂存区，后台线程按刷盘间隔、暂存区水位和日志级别被唤醒，批量写出
+// 二进制模式下不在调用线程格式化，只记录调用点id、单调时钟和原始参数，由log_decoder离线还原成文本
 // 使用了单例懒汉模式,保证只有一个日志类，在第一次使用时才会实例化一个对象，该对象是static的，所以会一直存在，
 //下一次在调用还是同一个对象，同时C++11之后保证了静态局部变量的线程安全，所以使用它时不用加锁
 class Log
@@ -28,36 +84,84 @@ public:
     static void* flush_log_thread(void* arg)
     {
         Log::get_instance()->async_write_log();
+        return nullptr;
+    }
+
+    //压缩线程，同样通过get_instance()访问成员
+    static void* compress_log_thread(void* arg)
+    {
+        Log::get_instance()->compress_log();
+        return nullptr;
     }
 
-    //初始化，可以设置日志文件名、日志缓冲区大小、最大行数等
-    bool init(const char* file_name, int close_log, int log_buf_size = 8192, int split_lines = 5000000, int max_queue_size = 0);
+    //初始化，可以设置日志文件名、日志缓冲区大小、最大行数、刷盘间隔等，max_queue_size大于0时异步写，binary为true时写二进制日志（总是异步）
+    //overflow为异步写时暂存区放不下的处理方式，见LOG_OVERFLOW_*
+    //换下来的日志文件由压缩线程压缩成.gz，之后最多保留keep_files个文件、keep_bytes字节，为0时不限制
+    bool init(const char* file_name, int close_log, int log_buf_size = 8192, int split_lines = 5000000, int max_queue_size = 0,
+              bool binary = false, int overflow = LOG_OVERFLOW_BLOCK, int keep_files = 0, long long keep_bytes = 0,
+              int flush_interval_ms = LOG_FLUSH_INTERVAL_MS);
 
     //将输出内容按照标准格式整理，并根据是同步还是异步读写选择相应的写方法
-    void write_log(int level, const char* format, ...);
+    //site指向调用点的静态变量，二进制模式下第一次调用时登记格式串，之后只记录它的id
+    void write_log(int level, int *site, const char* format, ...);
+
+    //运行期级别，低于它的日志在宏里一次比较就跳过，参数都不求值
+    static int level() { return __atomic_load_n(&m_level, __ATOMIC_RELAXED); }
+    //设置运行期级别，超出范围的值截到DEBUG到ERROR之间，返回设置后的级别
+    static int set_level(int level);
+
+    //因暂存区放不下而丢弃的level级别日志行数
+    long long dropped(int level) { return __atomic_load_n(&m_dropped[level], __ATOMIC_RELAXED); }
 
     //强制刷新缓冲区
     //内部调用的fflush()会强迫将缓冲区内的数据写回参数指定的文件中
+    //平时不用调用，缓冲区写满、到了刷盘间隔或者写了ERROR日志时会自动刷盘
     void flush(void);
+    //同步写时到了刷盘间隔就刷盘，由定时器调用，没有日志写入时缓冲的内容也能按时落盘
+    //异步写时后台线程每个刷盘间隔都会醒来写出，这里什么都不做
+    void flush_idle(void);
 private:
     //构造和析构定义成私有的，这样保证了只会有一个实例
     Log();
     virtual ~Log();
 
-    //供异步写调用的私有方法
-    void* async_write_log()
-    {
-        string single_log;
-
-        //从阻塞队列中取出一个日志string，写入文件中
-        while(m_log_queue->pop(single_log))
-        {
-            m_mutex.lock();
-            //输出到文件中
-            fputs(single_log.c_str(), m_fp);
-            m_mutex.unlock();
-        }
-    }
+    //后台线程：等到被唤醒或者到了刷盘间隔，把所有暂存区写出
+    void async_write_log();
+
+    //刚写了一行级别为level的日志（没写时为-1），ERROR级别或者到了刷盘间隔时刷盘，调用者持有m_mutex
+    void flush_if_due(int level);
+    //到了新的一天或者写满了m_split_lines行时换一个日志文件，调用者持有m_mutex
+    //同步写时由写日志的线程调用，异步写时由后台线程调用，旧文件交给压缩线程
+    void rotate(const struct tm &my_tm);
+    //异步写时要求后台线程换文件，多个线程同时要求时只唤醒一次
+    void request_rotate();
+    //压缩线程：压缩换下来的日志文件并按数量和大小清理旧文件
+    void compress_log();
+    //把一个日志文件压缩成.gz并删除原文件，退出时中断返回false
+    bool compress_file(const string &path);
+    //启动时把上次没来得及压缩的日志文件加入压缩队列
+    void scan_uncompressed();
+    //删除最旧的日志文件，直到数量和总大小都在限制以内
+    void enforce_retention();
+
+    //取本线程的暂存区，第一次调用时领一个空闲的或者新建一个
+    log_stage *get_stage();
+    //把一行日志追加到暂存区，空间不够时按m_overflow等待或者丢弃
+    void append(log_stage *stage, const char *line, int len, int level);
+    //后台线程写空暂存区后调用，上一轮以来没有新的丢弃（压力已经过去）或者force时，把没报告过的丢弃行数作为一行日志写出
+    void write_drop_summary(bool force);
+    //唤醒后台线程
+    void wakeup();
+    //二进制模式下记录一次日志
+    void write_binary(int level, int *site, const char *format, va_list valst);
+    //登记调用点并把定义写进日志文件，返回调用点id
+    int register_site(int *site, const char *format);
+    //在新打开的二进制日志文件开头写文件头和所有调用点定义，调用者持有m_mutex
+    void write_header();
+    //计算下一个零点，用来判断是否要按天换文件
+    void update_day_end(const struct tm &my_tm);
+    //把所有暂存区里的内容写进文件，返回是否写出了内容
+    bool drain();
 private:
 
     char dir_name[128];               // 输出路径名
@@ -66,18 +170,81 @@ private:
     int m_log_buf_size;               // 日志缓冲区大小
     long long m_count;                // 日志行数
     int m_today;                      // 记录当前是哪一天
+    long long m_segment;              // 今天已经按行数切分的次数，新文件的后缀
+    char m_file_name[256];            // 当前日志文件名
     FILE* m_fp;                       // 打开log的文件指针
-    char *m_buf;                      // 要输出的内容
-    block_queue<string> *m_log_queue; // 循环阻塞队列
+    char *m_buf;                      // 同步写时格式化用的缓冲
     bool m_is_async;                  // 异步还是同步输出
-    locker m_mutex;                   // 互斥锁
+    locker m_mutex;                   // 保护日志文件
     int m_close_log;                  // 是否关闭日志
+    char *m_file_buf;                 // 日志文件的stdio缓冲区
+    int m_flush_interval;             // 刷盘间隔（毫秒）
+    long long m_last_flush;           // 上次刷盘的时间（毫秒）
+
+    log_stage *m_stages;              // 所有线程的暂存区
+    pthread_t m_tid;                  // 后台线程
+    locker m_wake_lock;               // 保护下面几个字段
+    cond m_wake_cond;                 // 唤醒后台线程
+    cond m_space_cond;                // 后台线程写出后唤醒等空间的线程
+    bool m_wakeup;                    // 有线程要求后台线程立即写出
+    int m_space_waiters;              // 等待暂存区空间的线程数
+    bool m_stop;                      // 退出时让后台线程写完剩下的内容后结束
+    int m_overflow;                   // 暂存区放不下时的处理方式
+    long long m_dropped[4];           // 各级别丢弃的行数
+    long long m_reported[4];          // 已经写进日志的丢弃行数，只有后台线程访问
+    long long m_drop_seen;            // 上一轮看到的丢弃总数，只有后台线程访问
+    bool m_rotate_pending;            // 有线程要求后台线程换文件
+
+    pthread_t m_compress_tid;         // 压缩线程
+    bool m_compress_started;          // 压缩线程是否已经启动
+    locker m_compress_lock;           // 保护压缩队列和m_compress_stop
+    cond m_compress_cond;             // 有文件要压缩或者要退出时唤醒压缩线程
+    deque<string> m_compress_queue;   // 等待压缩的日志文件
+    bool m_compress_stop;             // 让压缩线程退出
+    int m_keep_files;                 // 最多保留的日志文件数，0为不限制
+    long long m_keep_bytes;           // 日志文件最多占用的字节数，0为不限制
+
+    bool m_binary;                    // 是否写二进制日志
+    log_site *m_sites[LOG_MAX_SITES]; // 调用点id到参数信息
+    int m_site_count;                 // 已登记的调用点数
+    string m_site_defs;               // 所有调用点定义，换文件时重新写进新文件
+    int64_t m_anchor_real;            // 初始化时的墙上时间（纳秒）
+    int64_t m_anchor_mono;            // 同一时刻的单调时钟（纳秒）
+    time_t m_day_end;                 // 下一个零点，二进制模式按它判断换文件，不用每条都算localtime
+
+    static int m_level;               // 运行期级别，静态成员，宏里判断时不用先取单例
 };
 
 //通过可变参数宏格式化输出, format是格式字符串
 //__VA_ARGS__用来接收可变的参数，前面两个##是为了在可变参数个数为0时去掉前面的“，”否则会编译出错
-#define LOG_DEBUG(format, ...) if(0 == m_close_log) {Log::get_instance()->write_log(0, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#define LOG_INFO(format, ...) if(0 == m_close_log) {Log::get_instance()->write_log(1, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#define LOG_WARN(format, ...) if(0 == m_close_log) {Log::get_instance()->write_log(2, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#define LOG_ERROR(format, ...) if(0 == m_close_log) {Log::get_instance()->write_log(3, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#endif
\ No newline at end of file
+//写完不再逐行fflush，何时刷盘由日志类按缓冲区、时间间隔和级别决定
+//每个调用点有一个静态的log_site，二进制模式下记录调用点登记后的id
+//低于LOG_MIN_LEVEL的宏展开为if(0)里的调用，参数仍被引用（不会有未使用变量的警告）但不会求值，编译器直接去掉；低于运行期级别的调用在取单例和求值参数之前就被跳过
+#define LOG_WRITE(lv, format, ...) if(0 == m_close_log && (lv) >= Log::level()) {static int log_site = 0; Log::get_instance()->write_log(lv, &log_site, format, ##__VA_ARGS__);}
+#define LOG_DISABLED(lv, format, ...) if(0) {LOG_WRITE(lv, format, ##__VA_ARGS__)}
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) LOG_WRITE(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) LOG_DISABLED(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) LOG_WRITE(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) LOG_DISABLED(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...) LOG_WRITE(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(format, ...) LOG_DISABLED(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#endif
+#define LOG_ERROR(format, ...) LOG_WRITE(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+
+//运维操作的记录（调整日志级别、重新加载配置等）：不受LOG_MIN_LEVEL和运行期级别限制，总是写出
+//按INFO写，不计入ERROR，也不会像ERROR那样立即刷盘
+#define LOG_NOTICE(format, ...) if(0 == m_close_log) {static int log_site = 0; Log::get_instance()->write_log(LOG_LEVEL_INFO, &log_site, format, ##__VA_ARGS__);}
+
+//按连接跟踪的DEBUG细节：on为真时不看日志级别直接写出，否则和LOG_DEBUG一样
+//不受LOG_MIN_LEVEL限制，编译期去掉DEBUG时没有被跟踪的连接只剩on这一个判断
+#define LOG_TRACE(on, format, ...) if(0 == m_close_log && ((on) || (LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG && LOG_LEVEL_DEBUG >= Log::level()))) {static int log_site = 0; Log::get_instance()->write_log(LOG_LEVEL_DEBUG, &log_site, format, ##__VA_ARGS__);}
+#endif
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "binlog.h"
+
+using namespace std;
+
+// 二进制日志离线解码工具，把Log写出的二进制日志还原成和文本日志相同格式的行
+// 用法：./log_decoder 文件...，结果输出到标准输出，压缩过的.gz文件可以直接解码
+
+// 一个调用点的定义
+struct site_def
+{
+    string format;
+    string types;
+};
+
+static const char *level_name(int level)
+{
+    switch (level)
+    {
+    case 0:
+        return "[debug]:";
+    case 2:
+        return "[warn]:";
+    case 3:
+        return "[erro]:";
+    default:
+        return "[info]:";
+    }
+}
+
+// 解码时取出的一个参数
+struct arg_value
+{
+    char type;
+    long long l;
+    double d;
+    string s;
+};
+
+// 按类型串从p开始取出参数，越过end时返回false
+static bool read_args(const char *p, const char *end, const string &types, vector<arg_value> &args)
+{
+    args.clear();
+    for (size_t i = 0; i < types.size(); ++i)
+    {
+        arg_value v;
+        v.type = types[i];
+        v.l = 0;
+        v.d = 0;
+        if (v.type == 'i')
+        {
+            int x;
+            if (end - p < (long)sizeof(x))
+                return false;
+            memcpy(&x, p, sizeof(x));
+            p += sizeof(x);
+            v.l = x;
+        }
+        else if (v.type == 'l')
+        {
+            if (end - p < (long)sizeof(v.l))
+                return false;
+            memcpy(&v.l, p, sizeof(v.l));
+            p += sizeof(v.l);
+        }
+        else if (v.type == 'd')
+        {
+            if (end - p < (long)sizeof(v.d))
+                return false;
+            memcpy(&v.d, p, sizeof(v.d));
+            p += sizeof(v.d);
+        }
+        else
+        {
+            uint16_t len;
+            if (end - p < (long)sizeof(len))
+                return false;
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            if (end - p < len)
+                return false;
+            v.s.assign(p, len);
+            p += len;
+        }
+        args.push_back(v);
+    }
+    return p == end;
+}
+
+// 格式化一个转换说明，spec为完整的转换说明，widths为'*'宽度和精度，v为最后的参数
+static void format_spec(string &out, const string &spec, const int *widths, int nwidths, const arg_value &v)
+{
+    char buf[4096];
+    char conv = spec[spec.size() - 1];
+    const char *f = spec.c_str();
+    int n = 0;
+
+#define FORMAT_ARG(x)                                                   \
+    do                                                                  \
+    {                                                                   \
+        if (nwidths == 0)                                               \
+            n = snprintf(buf, sizeof(buf), f, x);                       \
+        else if (nwidths == 1)                                          \
+            n = snprintf(buf, sizeof(buf), f, widths[0], x);            \
+        else                                                            \
+            n = snprintf(buf, sizeof(buf), f, widths[0], widths[1], x); \
+    } while (0)
+
+    if (conv == 'p')
+        FORMAT_ARG((void *)v.l);
+    else if (v.type == 'i')
+        FORMAT_ARG((int)v.l);
+    else if (v.type == 'l')
+        FORMAT_ARG(v.l);
+    else if (v.type == 'd')
+        FORMAT_ARG(v.d);
+    else
+        FORMAT_ARG(v.s.c_str());
+#undef FORMAT_ARG
+
+    if (n < 0)
+        return;
+    out.append(buf, (size_t)n < sizeof(buf) ? n : sizeof(buf) - 1);
+}
+
+// 按调用点的格式串和取出的参数还原日志内容
+static void format_message(string &out, const site_def &def, const vector<arg_value> &args)
+{
+    const char *format = def.format.c_str();
+    size_t next = 0;
+    for (const char *p = format; *p;)
+    {
+        if (*p != '%')
+        {
+            const char *q = strchr(p, '%');
+            size_t n = q ? q - p : strlen(p);
+            out.append(p, n);
+            p += n;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            out += '%';
+            p += 2;
+            continue;
+        }
+
+        string types;
+        const char *end = binlog_parse_spec(p + 1, types);
+        if (!end || next + types.size() > args.size())
+        {
+            out.append(p);
+            return;
+        }
+        // 'l'参数统一按long long存放，把长度修饰改成ll再格式化
+        string spec;
+        for (const char *c = p; c < end - 1; ++c)
+        {
+            if (!strchr("hlqjzt", *c))
+                spec += *c;
+        }
+        char conv = end[-1];
+        const arg_value &v = args[next + types.size() - 1];
+        if (v.type == 'l' && conv != 'p')
+            spec += "ll";
+        spec += conv;
+
+        int widths[2];
+        int nwidths = 0;
+        for (size_t i = 0; i + 1 < types.size(); ++i)
+            widths[nwidths++] = (int)args[next + i].l;
+        format_spec(out, spec, widths, nwidths, v);
+        next += types.size();
+        p = end;
+    }
+}
+
+static bool decode_file(const char *path)
+{
+    //gzread也能读没有压缩的文件
+    gzFile fp = gzopen(path, "rb");
+    if (!fp)
+    {
+        perror(path);
+        return false;
+    }
+    string data;
+    char chunk[65536];
+    int n;
+    while ((n = gzread(fp, chunk, sizeof(chunk))) > 0)
+        data.append(chunk, n);
+    gzclose(fp);
+
+    unordered_map<uint32_t, site_def> sites;
+    vector<arg_value> args;
+    string line;
+    int64_t real_ns = 0, mono_ns = 0;
+    bool have_header = false;
+    long long records = 0, skipped = 0;
+
+    const char *base = data.data();
+    size_t len = data.size(), pos = 0;
+    while (pos < len)
+    {
+        // 换文件或者多次启动追加到同一个文件时，中间会出现新的文件头
+        if (len - pos >= sizeof(binlog_header) && memcmp(base + pos, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) == 0)
+        {
+            binlog_header header;
+            memcpy(&header, base + pos, sizeof(header));
+            if (header.version != BINLOG_VERSION)
+            {
+                fprintf(stderr, "%s: unsupported version %u\n", path, header.version);
+                return false;
+            }
+            real_ns = header.real_ns;
+            mono_ns = header.mono_ns;
+            have_header = true;
+            pos += sizeof(header);
+            continue;
+        }
+
+        binlog_record rec;
+        bool ok = have_header && len - pos >= sizeof(rec);
+        if (ok)
+        {
+            memcpy(&rec, base + pos, sizeof(rec));
+            ok = rec.size >= sizeof(rec) && rec.size <= len - pos && rec.reserved == 0;
+        }
+        const char *p = base + pos + sizeof(rec);
+        const char *end = base + pos + (ok ? rec.size : 0);
+
+        if (ok && rec.site == 0)
+        {
+            // 调用点定义：id、格式串、类型串
+            uint32_t id;
+            ok = end - p > (long)sizeof(id);
+            if (ok)
+            {
+                memcpy(&id, p, sizeof(id));
+                p += sizeof(id);
+                const char *format_end = (const char *)memchr(p, '\0', end - p);
+                const char *types_end = format_end ? (const char *)memchr(format_end + 1, '\0', end - format_end - 1) : nullptr;
+                ok = types_end != nullptr && types_end + 1 == end;
+                if (ok)
+                {
+                    site_def &def = sites[id];
+                    def.format.assign(p, format_end - p);
+                    def.types.assign(format_end + 1, types_end - format_end - 1);
+                }
+            }
+        }
+        else if (ok)
+        {
+            unordered_map<uint32_t, site_def>::iterator it = sites.find(rec.site);
+            int64_t mono;
+            ok = it != sites.end() && rec.level <= 3 && end - p >= (long)sizeof(mono);
+            if (ok)
+            {
+                memcpy(&mono, p, sizeof(mono));
+                p += sizeof(mono);
+                ok = read_args(p, end, it->second.types, args);
+            }
+            if (ok)
+            {
+                int64_t real = real_ns + (mono - mono_ns);
+                time_t t = real / 1000000000LL;
+                struct tm my_tm;
+                localtime_r(&t, &my_tm);
+                char prefix[64];
+                snprintf(prefix, sizeof(prefix), "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ",
+                         my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
+                         my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, (long)(real % 1000000000LL / 1000), level_name(rec.level));
+                line = prefix;
+                format_message(line, it->second, args);
+                line += '\n';
+                fwrite(line.data(), 1, line.size(), stdout);
+                ++records;
+            }
+        }
+
+        if (ok)
+        {
+            pos += rec.size;
+        }
+        else
+        {
+            // 记录损坏（比如进程崩溃时写了一半），逐字节往后找下一条能解析的记录
+            ++skipped;
+            ++pos;
+        }
+    }
+
+    if (skipped > 0)
+        fprintf(stderr, "%s: %lld records, skipped %lld bad bytes\n", path, records, skipped);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s binary_log...\n", argv[0]);
+        return 1;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!decode_file(argv[i]))
+            ret = 1;
+    }
+    return ret;
+}
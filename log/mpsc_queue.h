@@ -0,0 +1,245 @@
+/*************************************************************
+ *无锁的有界多生产者单消费者队列，接口和block_queue相同，另有pop_batch一次取多个
+ *每个槽位带一个序号，生产者用CAS抢占队尾位置，写好数据后更新槽位序号发布；只有一个消费者，按队首槽位的序号判断有没有数据
+ *消费者没数据可取时才在条件变量上睡眠，生产者只在消费者睡着时加锁唤醒它，平时push、pop都不碰锁
+ **************************************************************/
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <utility>
+#include "../lock/locker.h"
+using namespace std;
+
+// push可以在任意多个线程里调用；pop、pop_batch、front、clear只能在同一个消费者线程里调用
+template <class T>
+class mpsc_queue
+{
+public:
+    // 容量向上取到2的幂，用位与代替取模
+    mpsc_queue(int max_size = 1000)
+    {
+        if (max_size <= 0)
+        {
+            exit(-1);
+        }
+
+        m_max_size = 1;
+        while (m_max_size < max_size)
+            m_max_size <<= 1;
+        m_mask = m_max_size - 1;
+
+        m_cells = new cell[m_max_size];
+        // 槽位i的序号为i表示空闲，可以写第i个元素；为i+1表示第i个元素已写好，可以取
+        for (int i = 0; i < m_max_size; ++i)
+            m_cells[i].seq = i;
+
+        m_head = 0;
+        m_tail = 0;
+        m_sleeping = false;
+    }
+
+    ~mpsc_queue()
+    {
+        delete[] m_cells;
+    }
+
+    // 清空队列，只能由消费者调用
+    void clear()
+    {
+        T item;
+        while (try_pop(item))
+            ;
+    }
+
+    // 判断队列是否为满，其他线程同时在操作时只是一个近似值
+    bool full()
+    {
+        return size() >= m_max_size;
+    }
+
+    // 判断队列是否为空
+    bool empty()
+    {
+        return size() == 0;
+    }
+
+    // 返回队首元素,存到value中，只能由消费者调用
+    bool front(T &value)
+    {
+        cell &c = m_cells[m_head & m_mask];
+        if (__atomic_load_n(&c.seq, __ATOMIC_ACQUIRE) != m_head + 1)
+            return false;
+        value = c.data;
+        return true;
+    }
+
+    // 返回元素个数，包括已占位还没写好的元素
+    int size()
+    {
+        uint64_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+        return tail > head ? (int)(tail - head) : 0;
+    }
+
+    // 返回最大容量
+    int max_size()
+    {
+        return m_max_size;
+    }
+
+    // 往队列中添加元素，队列满时返回false；消费者在睡眠时唤醒它
+    bool push(const T &item)
+    {
+        uint64_t pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+        cell *c;
+        while (true)
+        {
+            c = &m_cells[pos & m_mask];
+            uint64_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+            int64_t diff = (int64_t)(seq - pos);
+            if (diff == 0)
+            {
+                // 槽位空闲，抢占这个位置，失败时pos被更新为新的队尾再试
+                if (__atomic_compare_exchange_n(&m_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                // 槽位里上一圈的元素还没被取走，队列满了
+                wakeup();
+                return false;
+            }
+            else
+            {
+                // 别的生产者已经占了这个位置
+                pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+            }
+        }
+
+        c->data = item;
+        __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+        wakeup();
+        return true;
+    }
+
+    // 取一个元素，队列空时一直等待
+    bool pop(T &item)
+    {
+        while (!try_pop(item))
+        {
+            if (!sleep(nullptr))
+                return false;
+        }
+        return true;
+    }
+
+    // 带有超时处理的pop
+    bool pop(T &item, int ms_timeout)
+    {
+        if (try_pop(item))
+            return true;
+        struct timespec t = deadline(ms_timeout);
+        sleep(&t);
+        return try_pop(item);
+    }
+
+    // 一次最多取max_items个元素放进items，队列空时最多等ms_timeout毫秒，返回取到的个数
+    int pop_batch(T *items, int max_items, int ms_timeout)
+    {
+        int n = 0;
+        while (n < max_items && try_pop(items[n]))
+            ++n;
+        if (n > 0 || max_items <= 0)
+            return n;
+
+        struct timespec t = deadline(ms_timeout);
+        sleep(&t);
+        while (n < max_items && try_pop(items[n]))
+            ++n;
+        return n;
+    }
+
+private:
+    // 槽位，序号和数据放在一起，生产者之间只在抢占队尾时竞争
+    struct cell
+    {
+        uint64_t seq;
+        T data;
+    };
+
+    // 队首元素写好了就取出来，否则返回false
+    bool try_pop(T &item)
+    {
+        cell &c = m_cells[m_head & m_mask];
+        if (__atomic_load_n(&c.seq, __ATOMIC_ACQUIRE) != m_head + 1)
+            return false;
+        item = std::move(c.data);
+        // 槽位留给下一圈的第m_head + m_max_size个元素
+        __atomic_store_n(&c.seq, m_head + m_max_size, __ATOMIC_RELEASE);
+        __atomic_store_n(&m_head, m_head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // 当前时间加上ms_timeout
+    static struct timespec deadline(int ms_timeout)
+    {
+        struct timespec t = {0, 0};
+        struct timeval now = {0, 0};
+        gettimeofday(&now, NULL);
+        long long usec = now.tv_usec + (long long)ms_timeout * 1000;
+        t.tv_sec = now.tv_sec + usec / 1000000;
+        t.tv_nsec = usec % 1000000 * 1000;
+        return t;
+    }
+
+    // 消费者睡眠等待生产者唤醒，t为空时不超时；被唤醒或超时都返回true，等待出错返回false
+    // 先在锁内置睡眠标志，再看一次队首：生产者要么看到标志来唤醒，要么它发布的元素在这里被看到
+    bool sleep(const struct timespec *t)
+    {
+        bool ok = true;
+        m_mutex.lock();
+        __atomic_store_n(&m_sleeping, true, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&m_cells[m_head & m_mask].seq, __ATOMIC_ACQUIRE) != m_head + 1)
+        {
+            if (t)
+                m_cond.timewait(m_mutex.get(), *t);
+            else
+                ok = m_cond.wait(m_mutex.get());
+        }
+        __atomic_store_n(&m_sleeping, false, __ATOMIC_RELAXED);
+        m_mutex.unlock();
+        return ok;
+    }
+
+    // 消费者睡着时才加锁唤醒，加锁保证唤醒不会落在它置标志和进入等待之间
+    void wakeup()
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&m_sleeping, __ATOMIC_SEQ_CST))
+            return;
+        m_mutex.lock();
+        m_cond.signal();
+        m_mutex.unlock();
+    }
+
+private:
+    cell *m_cells;
+    int m_max_size;
+    uint64_t m_mask;
+
+    // 队首只有消费者写，队尾由生产者CAS推进，分开放在不同的缓存行里
+    alignas(64) uint64_t m_head;
+    alignas(64) uint64_t m_tail;
+    alignas(64) bool m_sleeping;
+
+    // 只用于消费者睡眠和唤醒
+    locker m_mutex;
+    cond m_cond;
+};
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "trace_filter.h"
+
+trace_filter::trace_filter()
+{
+    m_generation = 0;
+    m_has_url = false;
+}
+
+trace_filter::~trace_filter()
+{
+}
+
+trace_filter *trace_filter::GetInstance()
+{
+    static trace_filter filter;
+    return &filter;
+}
+
+int trace_filter::load(const char *path)
+{
+    vector<net> nets;
+    vector<string> prefixes;
+    vector<int> fds;
+    int count = -1;
+
+    FILE *fp = fopen(path, "r");
+    if (fp)
+    {
+        count = 0;
+        char line[512];
+        while (fgets(line, sizeof(line), fp))
+        {
+            char type[16], value[256];
+            if (sscanf(line, "%15s %255s", type, value) != 2 || type[0] == '#')
+                continue;
+            if (strcmp(type, "ip") == 0)
+            {
+                // 地址/前缀长度，没有前缀长度时只匹配这一个地址
+                int bits = 32;
+                char *slash = strchr(value, '/');
+                if (slash)
+                {
+                    *slash = '\0';
+                    bits = atoi(slash + 1);
+                }
+                struct in_addr addr;
+                if (inet_pton(AF_INET, value, &addr) != 1 || bits < 0 || bits > 32)
+                    continue;
+                net n;
+                n.mask = bits == 0 ? 0 : 0xffffffffu << (32 - bits);
+                n.addr = ntohl(addr.s_addr) & n.mask;
+                nets.push_back(n);
+            }
+            else if (strcmp(type, "url") == 0)
+            {
+                prefixes.push_back(value);
+            }
+            else if (strcmp(type, "fd") == 0)
+            {
+                fds.push_back(atoi(value));
+            }
+            else
+            {
+                continue;
+            }
+            ++count;
+        }
+        fclose(fp);
+    }
+
+    m_lock.wrlock();
+    m_nets.swap(nets);
+    m_prefixes.swap(prefixes);
+    m_fds.swap(fds);
+    __atomic_store_n(&m_has_url, !m_prefixes.empty(), __ATOMIC_RELAXED);
+    // 规则换完再发布新版本号，连接看到新版本号时一定能读到新规则
+    __atomic_add_fetch(&m_generation, 1, __ATOMIC_RELEASE);
+    m_lock.unlock();
+    return count;
+}
+
+bool trace_filter::match_conn(const struct in_addr &addr, int fd)
+{
+    uint32_t host = ntohl(addr.s_addr);
+    bool found = false;
+    m_lock.rdlock();
+    for (size_t i = 0; i < m_nets.size() && !found; ++i)
+        found = (host & m_nets[i].mask) == m_nets[i].addr;
+    for (size_t i = 0; i < m_fds.size() && !found; ++i)
+        found = m_fds[i] == fd;
+    m_lock.unlock();
+    return found;
+}
+
+bool trace_filter::match_url(const char *url)
+{
+    bool found = false;
+    m_lock.rdlock();
+    for (size_t i = 0; i < m_prefixes.size() && !found; ++i)
+        found = strncmp(url, m_prefixes[i].c_str(), m_prefixes[i].size()) == 0;
+    m_lock.unlock();
+    return found;
+}
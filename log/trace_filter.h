@@ -0,0 +1,55 @@
+#ifndef TRACE_FILTER_H
+#define TRACE_FILTER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include "../lock/locker.h"
+
+using namespace std;
+
+// 按客户端挑出要跟踪的连接，被跟踪的连接不看全局日志级别，输出解析、处理和发送的DEBUG细节
+// 规则从配置文件加载，运行中收到SIGHUP时重新加载，每行一条：
+//   ip 192.168.1.0/24   客户端地址或网段
+//   url /api/           请求路径前缀
+//   fd 12               连接的文件描述符
+// #开头的行是注释；没有规则时不跟踪任何连接
+// 连接只在每个请求开始时看一次规则版本号，规则没变就沿用上次的结果，其余时间只检查连接上的标志
+class trace_filter
+{
+public:
+    // 单例模式
+    static trace_filter *GetInstance();
+
+    // 从文件加载规则并替换原有规则，返回规则数，文件打不开时返回-1并清空规则
+    int load(const char *path);
+    // 规则版本号，每次加载加一
+    int generation() { return __atomic_load_n(&m_generation, __ATOMIC_ACQUIRE); }
+    // 是否有按路径前缀的规则，没有时解析请求行不用查规则
+    bool has_url_rules() { return __atomic_load_n(&m_has_url, __ATOMIC_RELAXED); }
+
+    // 按客户端地址和文件描述符判断连接是否要跟踪
+    bool match_conn(const struct in_addr &addr, int fd);
+    // 按请求路径判断这个请求是否要跟踪
+    bool match_url(const char *url);
+
+private:
+    trace_filter();
+    ~trace_filter();
+
+    struct net
+    {
+        uint32_t addr; // 主机字节序
+        uint32_t mask;
+    };
+
+private:
+    rwlocker m_lock;
+    vector<net> m_nets;
+    vector<string> m_prefixes;
+    vector<int> m_fds;
+    int m_generation;
+    bool m_has_url;
+};
+#endif
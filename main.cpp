@@ -14,9 +14,9 @@ int main(int argc, char *argv[])
     WebServer server;
 
     // 初始化
-    server.init(config.PORT, user, passwd, databasename, config.LOGWrite,
-                config.OPT_LINGER, config.TRIGMode, config.sql_num, config.thread_num,
-                config.close_log, config.actor_model);
+    server.init(config.PORT, user, passwd, databasename, config.LOGWrite, config.LOGLevel, config.LOGOverflow, config.LOGFlush, config.access_rates,
+                config.OPT_LINGER, config.TRIGMode, config.sql_num, config.sql_min, config.thread_num,
+                config.max_thread_num, config.db_thread_num, config.sql_async, config.user_cache, config.user_filter, config.snapshot_interval, config.sql_local, config.user_store, config.store_latency, config.close_log, config.actor_model);
                 
     // 日志
     server.log_write();
@@ -2,82 +2,206 @@
 #define THREADPOOL_H
 
 #include <list>
+#include <atomic>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "../lock/locker.h"
-#include "../CGImysql/sql_connection_pool.h"
+#include "../log/log.h"
+
+// 线程池扩缩容相关参数
+const int POOL_ADJUST_INTERVAL_MS = 500; // 管理线程检查负载的周期
+const int POOL_GROW_WAIT_US = 5000;      // 平均排队时间超过5ms视为过载
+const int POOL_SHRINK_WAIT_US = 1000;    // 平均排队时间低于1ms才考虑收缩
+const double POOL_GROW_UTIL = 0.75;      // 线程利用率高于该值视为繁忙
+const double POOL_SHRINK_UTIL = 0.25;    // 线程利用率低于该值视为空闲
+const int POOL_GROW_STREAK = 2;          // 连续过载2个周期才扩容，防止抖动
+const int POOL_SHRINK_STREAK = 10;       // 连续空闲10个周期才缩容，防止抖动
 
 template <typename T>
 class threadpool
 {
 public:
-    threadpool(int actor_model, connection_pool *connPool, int thread_number = 8, int max_request = 10000);
+    // thread_number为最小（初始）线程数，max_thread_number为最大线程数，两者相等时线程数固定
+    threadpool(int actor_model, int thread_number = 8, int max_thread_number = 8, int close_log = 0, int max_request = 10000);
     ~threadpool();
     bool append(T *request, int state);
     bool append_p(T *request);
+    //向队列中添加已经解析完、需要访问数据库的请求，只有数据库线程池会收到这种任务
+    bool append_db(T *request);
+    //设置数据库线程池，解析出需要访问数据库的请求后转交给它，未设置时在本线程池内直接处理
+    void set_db_lane(threadpool<T> *db_lane);
+    // 当前线程数
+    int thread_count();
 
 private:
+    // 请求队列中的任务，记录入队时间用于统计排队时延
+    struct job
+    {
+        T *request;
+        long long enqueue_us;
+        bool db;              // 是否为数据库任务
+    };
+
     // 线程中运行函数worker， worker通过传入的this指针运行run，run不断从请求队列中取出请求进行处理
     // 之所以要这样处理，是因为线程创建函数pthread_create接受的函数必须是静态的，所以worker设置为静态的
     // 而静态成员函数无法访问非静态成员变量，所以要通过传入this指针，通过this指针来运行普通成员函数run来访问
     static void *worker(void *arg);
     void run();
+    // 管理线程，周期性根据排队时延和线程利用率调整线程数
+    static void *manager(void *arg);
+    void manage();
+    // 新建num个工作线程，调用前需持有m_queuelocker
+    bool add_threads(int num);
+    // 回收已经退出的工作线程，调用前需持有m_queuelocker
+    void join_retired();
+    static long long now_us();
 
 private:
-    int m_thread_number;         // 线程池中线程数
-    int m_max_requests;          // 请求队列中最大请求数
-    pthread_t *m_threads;        // 线程池数组，大小为m_thread_number
-    std::list<T *> m_workqueue;  // 请求队列
-    locker m_queuelocker;        // 保护请求队列的互斥锁
-    sem m_queuestat;             // 记录请求队列中请求数的信号量
-    connection_pool *m_connPool; // 数据库连接池
-    int m_actor_model;           // 模型选择，reactor或模拟proactor
+    int m_thread_number;           // 线程池中当前线程数
+    int m_min_threads;             // 最小线程数
+    int m_max_threads;             // 最大线程数
+    size_t m_max_requests;         // 请求队列中最大请求数
+    std::list<pthread_t> m_threads; // 存活的工作线程
+    std::list<pthread_t> m_retired; // 已退出等待join的工作线程
+    pthread_t m_manager;           // 管理线程
+    std::list<job> m_workqueue;    // 请求队列
+    locker m_queuelocker;          // 保护请求队列以及下面统计数据的互斥锁
+    sem m_queuestat;               // 记录请求队列中请求数的信号量
+    int m_actor_model;             // 模型选择，reactor或模拟proactor
+    threadpool<T> *m_db_lane;      // 数据库线程池
+    int m_close_log;               // 是否关闭日志
+
+    int m_retire;                  // 需要退出的线程数（缩容）
+    bool m_stop;                   // 线程池是否停止，由m_queuelocker保护
+    bool m_manager_stop;           // 管理线程是否停止，由m_manager_locker保护
+    long long m_wait_us;           // 本周期内任务排队总时长
+    long long m_wait_cnt;          // 本周期内出队任务数
+    std::atomic<long long> m_busy_us; // 本周期内线程处理任务总时长
+    std::atomic<int> m_active;        // 正在处理任务的线程数
+    int m_grow_streak;             // 连续过载周期数
+    int m_shrink_streak;           // 连续空闲周期数
+    locker m_manager_locker;       // 配合m_manager_cond让管理线程定时醒来或被立即唤醒退出
+    cond m_manager_cond;
 };
 
 // main函数中创建线程池
 template <typename T>
-threadpool<T>::threadpool(int actor_model, connection_pool *connPool, int thread_number, int max_requests)
-    : m_actor_model(actor_model), m_thread_number(thread_number), m_max_requests(max_requests), m_threads(nullptr), m_connPool(connPool)
+threadpool<T>::threadpool(int actor_model, int thread_number, int max_thread_number, int close_log, int max_requests)
+    : m_thread_number(0), m_min_threads(thread_number), m_max_threads(max_thread_number),
+      m_max_requests(max_requests), m_actor_model(actor_model), m_db_lane(nullptr), m_close_log(close_log), m_retire(0), m_stop(false), m_manager_stop(false),
+      m_wait_us(0), m_wait_cnt(0), m_busy_us(0), m_active(0), m_grow_streak(0), m_shrink_streak(0)
 {
     if(thread_number <= 0 || max_requests <= 0)
     {
         throw std::exception();
     }
+    //最大线程数不能小于最小线程数
+    if(m_max_threads < m_min_threads)
+    {
+        m_max_threads = m_min_threads;
+    }
 
-    //线程id数组初始化
-    m_threads = new pthread_t[m_thread_number];
-    if(!m_threads)
+    //创建thread_number个线程，线程不再分离，析构时统一join，保证关闭时干净退出
+    m_queuelocker.lock();
+    bool ok = add_threads(thread_number);
+    m_queuelocker.unlock();
+    if(!ok)
     {
         throw std::exception();
     }
 
-    //创建thread_number个线程
-    for(int i = 0; i < thread_number; ++i)
+    //线程数可伸缩时才需要管理线程
+    if(m_max_threads > m_min_threads)
     {
-        //pthread_create函数原型中的第三个参数，为函数指针，指向处理线程函数的地址。
-        //该函数，要求为静态函数。如果处理线程函数为类成员函数时，需要将其设置为静态成员函数。
-        //静态成员函数无法操作非静态类成员，所以要通过这个静态成员函数运行另一个函数run来操作
-        if(pthread_create(m_threads + i, nullptr, worker, this) != 0)
+        if(pthread_create(&m_manager, nullptr, manager, this) != 0)
         {
-            delete [] m_threads;
             throw std::exception();
         }
+    }
+}
+
+//析构函数，通知所有线程退出并join
+template <typename T>
+threadpool<T>::~threadpool()
+{
+    //先停止管理线程，避免退出过程中再扩缩容
+    if(m_max_threads > m_min_threads)
+    {
+        m_manager_locker.lock();
+        m_manager_stop = true;
+        m_manager_cond.signal();
+        m_manager_locker.unlock();
+        pthread_join(m_manager, nullptr);
+    }
+
+    m_queuelocker.lock();
+    m_stop = true;
+    std::list<pthread_t> threads = m_threads;
+    m_queuelocker.unlock();
+
+    //每个线程对应一次post，把阻塞在信号量上的线程都唤醒，线程看到m_stop后退出
+    for(size_t i = 0; i < threads.size(); ++i)
+    {
+        m_queuestat.post();
+    }
+    for(std::list<pthread_t>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        pthread_join(*it, nullptr);
+    }
+
+    m_queuelocker.lock();
+    join_retired();
+    m_queuelocker.unlock();
+}
 
-        //线程分离的作用就是让线程自己退出时，自动释放线程资源,这样就不需要主线程等它了
-        if(pthread_detach(m_threads[i]))
+template <typename T>
+bool threadpool<T>::add_threads(int num)
+{
+    for(int i = 0; i < num; ++i)
+    {
+        pthread_t tid;
+        //pthread_create函数原型中的第三个参数，为函数指针，指向处理线程函数的地址。
+        //该函数，要求为静态函数。如果处理线程函数为类成员函数时，需要将其设置为静态成员函数。
+        //静态成员函数无法操作非静态类成员，所以要通过这个静态成员函数运行另一个函数run来操作
+        if(pthread_create(&tid, nullptr, worker, this) != 0)
         {
-            delete[] m_threads;
-            throw std::exception();
+            return false;
         }
+        m_threads.push_back(tid);
+        ++m_thread_number;
     }
+    return true;
 }
 
-//析构函数，释放线程池
 template <typename T>
-threadpool<T>::~threadpool()
+void threadpool<T>::join_retired()
+{
+    //已退出的线程join之后其资源才会释放，这里join的线程都已经退出run，不会阻塞
+    while(!m_retired.empty())
+    {
+        pthread_join(m_retired.front(), nullptr);
+        m_retired.pop_front();
+    }
+}
+
+template <typename T>
+int threadpool<T>::thread_count()
+{
+    m_queuelocker.lock();
+    int n = m_thread_number;
+    m_queuelocker.unlock();
+    return n;
+}
+
+template <typename T>
+long long threadpool<T>::now_us()
 {
-    delete [] m_threads;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
 }
 
 //reactor模式向队列中添加http请求，通过互斥锁保证线程安全，信号量表示用多少请求，state表示是读还是写（工作线程需要负责写事件），读的话先把数据读出来然后调用process
@@ -97,8 +221,9 @@ bool threadpool<T>::append(T* request, int state)
     //给requests标识状态，是读还是写
     request->m_state = state;
 
-    //添加任务
-    m_workqueue.push_back(request);
+    //添加任务，记录入队时间
+    job j = {request, now_us(), false};
+    m_workqueue.push_back(j);
     m_queuelocker.unlock();
 
     //信号量+1
@@ -116,12 +241,36 @@ bool threadpool<T>::append_p(T *request)
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back(request);
+    job j = {request, now_us(), false};
+    m_workqueue.push_back(j);
+    m_queuelocker.unlock();
+    m_queuestat.post();
+    return true;
+}
+
+//数据库请求入队，process已经完成解析，工作线程只需调用process_db
+template <typename T>
+bool threadpool<T>::append_db(T *request)
+{
+    m_queuelocker.lock();
+    if (m_workqueue.size() >= m_max_requests)
+    {
+        m_queuelocker.unlock();
+        return false;
+    }
+    job j = {request, now_us(), true};
+    m_workqueue.push_back(j);
     m_queuelocker.unlock();
     m_queuestat.post();
     return true;
 }
 
+template <typename T>
+void threadpool<T>::set_db_lane(threadpool<T> *db_lane)
+{
+    m_db_lane = db_lane;
+}
+
 //worker通过this调用普通私有成员函数run来取出并处理请求
 template <typename T>
 void* threadpool<T>::worker(void* arg)
@@ -144,24 +293,62 @@ void threadpool<T>::run()
         //处理前抢锁
         m_queuelocker.lock();
 
+        //线程池析构，直接退出
+        if(m_stop)
+        {
+            m_queuelocker.unlock();
+            break;
+        }
+
         //抢到锁之后先判断还有没有资源，防止已经被其他线程取完
         if(m_workqueue.empty())
         {
+            //队列为空且有缩容请求，当前线程退出，交给管理线程join
+            if(m_retire > 0)
+            {
+                --m_retire;
+                --m_thread_number;
+                pthread_t self = pthread_self();
+                for(typename std::list<pthread_t>::iterator it = m_threads.begin(); it != m_threads.end(); ++it)
+                {
+                    if(pthread_equal(*it, self))
+                    {
+                        m_threads.erase(it);
+                        break;
+                    }
+                }
+                m_retired.push_back(self);
+                m_queuelocker.unlock();
+                break;
+            }
             m_queuelocker.unlock();
             continue; //已经被取完的话重新进入循环继续等待
         }
 
-        //资源还在的话取出第一个任务
-        T* request = m_workqueue.front();
+        //资源还在的话取出第一个任务，并统计排队时延
+        job j = m_workqueue.front();
         m_workqueue.pop_front();
+        long long start = now_us();
+        m_wait_us += start - j.enqueue_us;
+        ++m_wait_cnt;
+        ++m_active;
         m_queuelocker.unlock();
-        
+
+        T* request = j.request;
         if(!request)
+        {
+            --m_active;
             continue;
+        }
 
+        //数据库任务，数据库连接在真正查询时才获取
+        if(j.db)
+        {
+            request->process_db();
+        }
         //开始处理任务
         //reactor模式，工作线程需要负责处理读和写
-        if( m_actor_model == 1) 
+        else if( m_actor_model == 1) 
         {
             //读事件
             if(request->m_state == 0)
@@ -170,8 +357,6 @@ void threadpool<T>::run()
                 {
                     //读成功的话将improv标志为1通知主线程
                     request->improv = 1;
-                    //利用RAII机制取一条数据库连接用于处理请求
-                    connectionRAII mysqlcon(&request->mysql, m_connPool);
                     //读取成功之后运行http请求处理函数（http请求处理的入口）
                     request->process();
                 }
@@ -199,9 +384,129 @@ void threadpool<T>::run()
         //proactor
         else
         {
-            connectionRAII mysqlcon(&request->mysql, m_connPool);
             request->process();
         }
+
+        //解析出是登录、注册请求，转交数据库线程池，静态资源请求不会排在数据库请求后面
+        if(!j.db && request->db_flag == 1)
+        {
+            if(!m_db_lane || !m_db_lane->append_db(request))
+            {
+                //没有数据库线程池或其队列已满，在当前线程处理
+                request->process_db();
+            }
+        }
+        //忙碌时长和活跃线程数用原子变量统计，不用再抢一次队列锁
+        m_busy_us += now_us() - start;
+        --m_active;
+    }
+}
+
+template <typename T>
+void* threadpool<T>::manager(void* arg)
+{
+    threadpool *pool = (threadpool* )arg;
+    pool->manage();
+    return pool;
+}
+
+//管理线程，每个周期根据平均排队时延和线程利用率决定扩容还是缩容
+//扩容和缩容都要求连续多个周期满足条件（迟滞），避免线程数来回抖动
+template <typename T>
+void threadpool<T>::manage()
+{
+    long long last = now_us();
+    while(true)
+    {
+        //定时醒来，析构时会被立即唤醒
+        m_manager_locker.lock();
+        if(!m_manager_stop)
+        {
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_sec += POOL_ADJUST_INTERVAL_MS / 1000;
+            t.tv_nsec += (POOL_ADJUST_INTERVAL_MS % 1000) * 1000000L;
+            if(t.tv_nsec >= 1000000000L)
+            {
+                t.tv_sec += 1;
+                t.tv_nsec -= 1000000000L;
+            }
+            m_manager_cond.timewait(m_manager_locker.get(), t);
+        }
+        bool stop = m_manager_stop;
+        m_manager_locker.unlock();
+        if(stop)
+            break;
+
+        long long now = now_us();
+        long long interval = now - last;
+        last = now;
+        if(interval <= 0)
+            continue;
+
+        m_queuelocker.lock();
+        join_retired();
+
+        //本周期的平均排队时延和线程利用率
+        long long avg_wait = m_wait_cnt > 0 ? m_wait_us / m_wait_cnt : 0;
+        //队列里还没取走的任务也要算上排队时间，否则线程全忙时统计不到
+        if(!m_workqueue.empty())
+        {
+            long long oldest = now - m_workqueue.front().enqueue_us;
+            if(oldest > avg_wait)
+                avg_wait = oldest;
+        }
+        //利用率取本周期已完成任务的忙碌占比和此刻正在处理任务的线程占比中的较大者，
+        //后者用来覆盖长时间阻塞（如等待数据库）还没结束的任务
+        double util = (double)m_busy_us.exchange(0) / ((double)interval * m_thread_number);
+        double active = (double)m_active.load() / m_thread_number;
+        if(active > util)
+            util = active;
+        m_wait_us = 0;
+        m_wait_cnt = 0;
+
+        if(avg_wait > POOL_GROW_WAIT_US && util > POOL_GROW_UTIL)
+        {
+            m_shrink_streak = 0;
+            ++m_grow_streak;
+        }
+        else if(avg_wait < POOL_SHRINK_WAIT_US && util < POOL_SHRINK_UTIL)
+        {
+            m_grow_streak = 0;
+            ++m_shrink_streak;
+        }
+        else
+        {
+            m_grow_streak = 0;
+            m_shrink_streak = 0;
+        }
+
+        int before = m_thread_number;
+        //过载时每次扩容1/4，至少1个，不超过最大线程数
+        if(m_grow_streak >= POOL_GROW_STREAK && m_thread_number < m_max_threads)
+        {
+            int num = m_thread_number / 4;
+            if(num < 1)
+                num = 1;
+            if(m_thread_number + num > m_max_threads)
+                num = m_max_threads - m_thread_number;
+            add_threads(num);
+            m_grow_streak = 0;
+        }
+        //空闲时每次只退出一个线程，缓慢收缩到最小线程数
+        else if(m_shrink_streak >= POOL_SHRINK_STREAK && m_thread_number - m_retire > m_min_threads)
+        {
+            ++m_retire;
+            m_queuestat.post();
+            m_shrink_streak = 0;
+        }
+        int after = m_thread_number;
+        m_queuelocker.unlock();
+
+        if(after != before)
+        {
+            LOG_INFO("threadpool resize %d -> %d, avg wait %lldus, util %.2f", before, after, avg_wait, util);
+        }
     }
 }
-#endif
\ No newline at end of file
+#endif
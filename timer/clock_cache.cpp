@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <string.h>
+#include "clock_cache.h"
+
+time_t clock_cache::m_now = 0;
+long long clock_cache::m_mono_ms = 0;
+uint32_t clock_cache::m_seq = 0;
+clock_text clock_cache::m_text;
+
+// 不依赖locale，Date头要求英文的星期和月份
+static const char *week_names[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *month_names[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+time_t clock_cache::refresh()
+{
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME_COARSE, &real);
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &mono);
+    __atomic_store_n(&m_mono_ms, mono.tv_sec * 1000LL + mono.tv_nsec / 1000000, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_now, real.tv_sec, __ATOMIC_RELAXED);
+    return real.tv_sec;
+}
+
+void clock_cache::update()
+{
+    time_t sec = refresh();
+    clock_text cur;
+    if (load(cur) && cur.sec == sec)
+        return;
+    clock_text next;
+    format(sec, next);
+    store(next);
+}
+
+void clock_cache::text(time_t sec, clock_text &out)
+{
+    if (load(out) && out.sec == sec)
+        return;
+    format(sec, out);
+    // 只往前更新，时间不会被落后的线程改回去
+    if (sec > __atomic_load_n(&m_text.sec, __ATOMIC_RELAXED))
+        store(out);
+}
+
+bool clock_cache::load(clock_text &out)
+{
+    uint32_t seq = __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return false;
+    memcpy(&out, &m_text, sizeof(out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&m_seq, __ATOMIC_RELAXED) == seq && out.sec != 0;
+}
+
+void clock_cache::format(time_t sec, clock_text &out)
+{
+    out.sec = sec;
+    localtime_r(&sec, &out.tm);
+    const struct tm &t = out.tm;
+    snprintf(out.log, sizeof(out.log), "%d-%02d-%02d %02d:%02d:%02d",
+             t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+
+    long off = t.tm_gmtoff / 60;
+    char sign = off < 0 ? '-' : '+';
+    if (off < 0)
+        off = -off;
+    snprintf(out.access, sizeof(out.access), "%02d/%s/%d:%02d:%02d:%02d %c%02ld%02ld",
+             t.tm_mday, month_names[t.tm_mon], t.tm_year + 1900, t.tm_hour, t.tm_min, t.tm_sec,
+             sign, off / 60, off % 60);
+
+    struct tm g;
+    gmtime_r(&sec, &g);
+    snprintf(out.http, sizeof(out.http), "%s, %02d %s %d %02d:%02d:%02d GMT",
+             week_names[g.tm_wday], g.tm_mday, month_names[g.tm_mon], g.tm_year + 1900,
+             g.tm_hour, g.tm_min, g.tm_sec);
+}
+
+void clock_cache::store(const clock_text &text)
+{
+    uint32_t seq = __atomic_load_n(&m_seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&m_seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&m_text, &text, sizeof(m_text));
+    __atomic_store_n(&m_seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,63 @@
+#ifndef CLOCK_CACHE_H
+#define CLOCK_CACHE_H
+
+#include <time.h>
+#include <stdint.h>
+
+// 按秒预先格式化好的时间
+struct clock_text
+{
+    time_t sec;        // 对应的墙上时间（秒）
+    struct tm tm;      // 本地时间
+    char log[20];      // 日志行前缀，"2024-01-02 03:04:05"
+    char access[32];   // 访问日志时间，"02/Jan/2024:03:04:05 +0800"
+    char http[32];     // RFC 7231的Date头，"Tue, 02 Jan 2024 03:04:05 GMT"
+};
+
+// 缓存的时钟，主循环每轮调用一次update，从COARSE时钟读当前时间
+// 定时器、会话过期等秒级的判断直接读缓存的秒数，不再每次调用time
+// 日志、访问日志和响应头要的时间字符串每秒只格式化一次，其他线程按秒数取用，不再每行调用localtime（glibc里要加锁）
+class clock_cache
+{
+public:
+    // 主循环每轮调用一次，更新缓存的时间，秒数变了时重新格式化
+    static void update();
+
+    // 缓存的墙上时间（秒）
+    static time_t now()
+    {
+        time_t t = __atomic_load_n(&m_now, __ATOMIC_RELAXED);
+        return t ? t : refresh();
+    }
+    // 缓存的单调时钟（毫秒）
+    static long long mono_ms()
+    {
+        if (__atomic_load_n(&m_now, __ATOMIC_RELAXED) == 0)
+            refresh();
+        return __atomic_load_n(&m_mono_ms, __ATOMIC_RELAXED);
+    }
+
+    // 取sec这一秒格式化好的时间，缓存的不是这一秒时就地格式化并尽量更新缓存
+    static void text(time_t sec, clock_text &out);
+    // 取缓存时间这一秒格式化好的时间
+    static void text(clock_text &out) { text(now(), out); }
+
+private:
+    // 读一次COARSE时钟更新缓存的秒数和毫秒数，返回秒数
+    static time_t refresh();
+    // 读出缓存的字符串，写的线程正在更新时返回false
+    static bool load(clock_text &out);
+    // 按秒数格式化
+    static void format(time_t sec, clock_text &out);
+    // 把新格式化的时间放进缓存，别的线程正在写时放弃
+    static void store(const clock_text &text);
+
+private:
+    static time_t m_now;
+    static long long m_mono_ms;
+    // 顺序锁：写时变为奇数，写完变为偶数，读的前后不变才算读到完整的一份
+    static uint32_t m_seq;
+    static clock_text m_text;
+};
+
+#endif
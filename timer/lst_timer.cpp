@@ -127,8 +127,8 @@ void sort_timer_lst::tick()
         return;
     }
 
-    // 获取当前时间
-    time_t cur = time(nullptr);
+    // 获取当前时间，主循环每轮更新的缓存时间就够秒级的定时器用
+    time_t cur = clock_cache::now();
     util_timer *tmp = head;
 
     // 遍历定时器链表
@@ -286,6 +286,9 @@ void cb_func(client_data *user_data)
     epoll_ctl(Utils::u_epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
     assert(user_data);
 
+    //连接上还有没结束的异步查询时先和它脱钩，关闭后fd可能马上被新连接复用
+    http_conn::abandon_sql(user_data->sockfd);
+
     //关闭文件描述符
     close(user_data->sockfd);
 
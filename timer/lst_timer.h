@@ -23,6 +23,7 @@
 
 #include <time.h>
 #include "../log/log.h"
+#include "clock_cache.h"
 
 // 资源类需要用到定时器类，所以前向声明一下
 class util_timer;
@@ -17,6 +17,11 @@ WebServer::WebServer()
 
     // 每个HTTP对象对应的对象数据，包含地址、文件描述符，指向定时器的指针（刚开始为空）
     users_timer = new client_data[MAX_FD];
+
+    m_pool = nullptr;
+    m_db_pool = nullptr;
+    m_connPool = nullptr;
+    m_store = nullptr;
 }
 
 WebServer::~WebServer()
@@ -25,22 +30,42 @@ WebServer::~WebServer()
     close(m_listenfd);  // 关闭listenfd
     close(m_pipefd[1]); // 关闭管道
     close(m_pipefd[0]);
+    // 先停普通线程池，它可能还在向数据库线程池转交请求
+    // 析构时会等工作线程退出，线程里可能还在处理连接，连接对象要等线程都退出后再释放
+    delete m_pool;
+    delete m_db_pool;
     delete[] users;
     delete[] users_timer;
-    delete m_pool;
+    // 请求都处理完了，最后转储一次用户缓存，下次启动直接加载
+    user_snapshot::GetInstance()->stop();
+    delete m_store;
 }
 
 // 初始化
-void WebServer::init(int port, string user, string passWord, string databaseName, int log_write,
-                     int opt_linger, int trigmode, int sql_num, int thread_num, int close_log, int actor_model)
+void WebServer::init(int port, string user, string passWord, string databaseName, int log_write, int log_level, int log_overflow, int log_flush, string access_rates,
+                     int opt_linger, int trigmode, int sql_num, int sql_min, int thread_num, int max_thread_num, int db_thread_num, int sql_async, int user_cache, int user_filter, int snapshot_interval, int sql_local, int user_store, int store_latency, int close_log, int actor_model)
 {
     m_port = port;
     m_user = user;
     m_passWord = passWord;
     m_databaseName = databaseName;
     m_sql_num = sql_num;
+    m_sql_min = sql_min;
     m_thread_num = thread_num;
+    m_max_thread_num = max_thread_num;
+    m_db_thread_num = db_thread_num;
+    m_sql_async = sql_async;
+    m_user_cache = user_cache;
+    m_user_filter = user_filter;
+    m_snapshot_interval = snapshot_interval;
+    m_sql_local = sql_local;
+    m_store_type = user_store;
+    m_store_latency = store_latency;
     m_log_write = log_write;
+    m_log_level = log_level;
+    m_log_overflow = log_overflow;
+    m_log_flush = log_flush;
+    m_access_rates = access_rates;
     m_OPT_LINGER = opt_linger;
     m_TRIGMode = trigmode;
     m_close_log = close_log;
@@ -79,36 +104,127 @@ void WebServer::trig_mode()
 // 根据是否关闭日志来选择是否初始化日志，并根据传入参数选择写入日志是异步还是同步
 void WebServer::log_write()
 {
+    Log::set_level(m_log_level);
     if (m_close_log == 0)
     {
         if (1 == m_log_write)
         {
-            Log::get_instance()->init("./ServerLog", m_close_log, 2000, 800000, 800);
+            Log::get_instance()->init("./ServerLog", m_close_log, 2000, 800000, 800, false, m_log_overflow, LOG_KEEP_FILES, LOG_KEEP_BYTES, m_log_flush);
+        }
+        else if (2 == m_log_write)
+        {
+            //二进制日志，用log_decoder还原成文本
+            Log::get_instance()->init("./ServerLog.bin", m_close_log, 2000, 800000, 800, true, m_log_overflow, LOG_KEEP_FILES, LOG_KEEP_BYTES, m_log_flush);
         }
         else
         {
-            Log::get_instance()->init("./ServerLog", m_close_log, 2000, 800000, 0);
+            Log::get_instance()->init("./ServerLog", m_close_log, 2000, 800000, 0, false, LOG_OVERFLOW_BLOCK, LOG_KEEP_FILES, LOG_KEEP_BYTES, m_log_flush);
         }
+
+        if (!access_log::GetInstance()->init(ACCESS_LOG_FILE, m_access_rates.c_str(), ACCESS_QUEUE_SIZE))
+            LOG_ERROR("open access log %s failed", ACCESS_LOG_FILE);
+
+        // 没有规则文件时不跟踪任何连接
+        int rules = trace_filter::GetInstance()->load(TRACE_CONF_FILE);
+        if (rules >= 0)
+            LOG_INFO("load %d trace rules from %s", rules, TRACE_CONF_FILE);
     }
 }
 
 // 获取数据库实例，初始化数据库连接池
 void WebServer::sql_pool()
 {
-    // 单例模式，为webserver获取数据库实例
-    m_connPool = connection_pool::GetInstance();
-    // 初始化数据库数据库主机名是本地"localhost"，端口3306
-    m_connPool->init("localhost", m_user, m_passWord, m_databaseName, 3306, m_sql_num, m_close_log);
+    if (m_store_type == 1)
+    {
+        // 进程内存储不需要MySQL，压测时用注入的延迟模拟数据库往返
+        m_store = new memory_store(m_store_latency, m_close_log);
+    }
+    else if (m_store_type == 2)
+    {
+        // 嵌入式存储，只用登录、注册时替代MySQL，打开失败时登录、注册都返回503
+        file_store *store = new file_store(m_close_log);
+        if (!store->open(USER_STORE_LOG_FILE, USER_STORE_INDEX_FILE))
+        {
+            LOG_ERROR("%s", "open user store failed, login and register unavailable");
+        }
+        m_store = store;
+    }
+    else
+    {
+        // 单例模式，为webserver获取数据库实例
+        m_connPool = connection_pool::GetInstance();
+        // 初始化数据库数据库主机名是本地"localhost"，端口3306，启动时建立m_sql_min条连接，按需增长到m_sql_num条
+        m_connPool->init("localhost", m_user, m_passWord, m_databaseName, 3306, m_sql_min, m_sql_num, SQL_ACQUIRE_TIMEOUT_MS, m_sql_local, m_close_log);
+        m_store = new mysql_store(m_connPool, m_close_log);
+    }
+    if (m_store_type != 0 && m_sql_async)
+    {
+        LOG_WARN("%s user store has no async api, fall back to sync queries", m_store->name());
+        m_sql_async = 0;
+    }
+    // 快照里的用户和hwm都是MySQL的，进程内存储要求每次运行都从空表开始，文件存储本身就是mmap加载的，都不用快照
+    if (m_store_type != 0 && m_snapshot_interval > 0)
+    {
+        LOG_INFO("%s user store does not use the user snapshot", m_store->name());
+        m_snapshot_interval = 0;
+    }
+
+    // 用户缓存限定容量时按需查库，启动不再加载整张用户表；不限容量时全量加载
+    user_cache::GetInstance()->init(m_user_cache, USER_NEGATIVE_TTL);
+    // 先加载上次的快照，全量模式加载了快照时先用快照处理请求，由后台线程重新读一遍用户表；没有快照时在这里全量加载
+    bool warm = user_snapshot::GetInstance()->init(m_store, USER_SNAPSHOT_FILE, m_snapshot_interval, m_user_cache == 0, m_close_log);
+    if (m_user_cache == 0 && !warm && !user_snapshot::GetInstance()->catch_up())
+    {
+        LOG_ERROR("load users from %s failed, user table not loaded", m_store->name());
+    }
+    // 按需加载时缓存里没有的用户名都要查库，开启过滤器时先用全部用户名建一个布隆过滤器，不存在的用户名直接挡掉
+    // 建过滤器要扫一遍用户表，而且看不到别的实例注册的用户，所以默认不开启
+    // 全量加载时缓存本身就能回答用户是否存在，不需要过滤器
+    if (m_user_cache > 0 && m_user_filter)
+    {
+        user_filter::GetInstance()->init(USER_FILTER_CAPACITY, USER_FILTER_FPR, m_close_log);
+        if (!user_filter::GetInstance()->build(m_store))
+        {
+            LOG_WARN("%s", "build user filter failed, every unknown name goes to the database");
+        }
+    }
+
+    // 登录会话，过期的由定时器清理
+    session_cache::GetInstance()->init(SESSION_CAPACITY, SESSION_TTL);
 
-    // 将数据库中数据取到本地存在map中
-    users->initmysql_result(m_connPool);
+    // 缓存未命中的并发查询按用户名合并
+    user_flight::GetInstance()->init(USER_FLIGHT_TIMEOUT_MS);
+
+    // 处理登录、注册请求时通过存储访问用户表，异步插入时直接从连接池取连接
+    http_conn::m_store = m_store;
+    http_conn::m_connPool = m_connPool;
+
+    // 注册请求组提交，1ms窗口内的注册合并成一条插入语句
+    register_batch::GetInstance()->init(m_store, REGISTER_BATCH_WINDOW_US, SQL_BATCH_MAX, m_close_log);
+
+    // 异步查询依赖mariadb的非阻塞接口，客户端库不支持时退回同步查询
+#ifdef SQL_ASYNC_SUPPORTED
+    http_conn::m_sql_async = m_sql_async;
+#else
+    if (m_sql_async)
+    {
+        LOG_WARN("%s", "mysql client has no non-blocking api, fall back to sync queries");
+    }
+#endif
 }
 
 // 创建线程池，运行线程函数
 void WebServer::thread_pool()
 {
     // 调用构造函数
-    m_pool = new threadpool<http_conn>(m_actormodel, m_connPool, m_thread_num);
+    m_pool = new threadpool<http_conn>(m_actormodel, m_thread_num, m_max_thread_num, m_close_log);
+
+    // 数据库线程池大小固定，登录、注册请求解析完后转到这里，数据库变慢时不会拖住静态资源请求
+    if (m_db_thread_num > 0)
+    {
+        m_db_pool = new threadpool<http_conn>(m_actormodel, m_db_thread_num, m_db_thread_num, m_close_log);
+        m_pool->set_db_lane(m_db_pool);
+    }
 }
 
 // 开始监听，创建内核事件表，创建管道用于发送信号，设定想要捕捉的信号，触发定时事件
@@ -186,6 +302,11 @@ void WebServer::eventListen()
     // 捕捉SIGALARM和SIGTERM两个信号，传入的sig_handler信号处理函数作用是通过管道发送给主循环
     utils.addsig(SIGALRM, utils.sig_handler, false);
     utils.addsig(SIGTERM, utils.sig_handler, false);
+    // SIGUSR1调低日志级别（输出更多），SIGUSR2调高日志级别，不用重启就能调整
+    utils.addsig(SIGUSR1, utils.sig_handler, false);
+    utils.addsig(SIGUSR2, utils.sig_handler, false);
+    // SIGHUP重新加载跟踪规则
+    utils.addsig(SIGHUP, utils.sig_handler, false);
     // 开始第一次定时触发SIG_ALARM信号，之后会通过超时处理函数不断重新设置定时信号
     alarm(TIMESLOT);
 
@@ -210,7 +331,7 @@ void WebServer::timer(int connfd, struct sockaddr_in client_address)
     // 设置超时定时器的回调函数
     timer->cb_func = cb_func;
     // 获取当前时间并设定超时时间为三倍的TIMESLOT;
-    time_t cur = time(nullptr);
+    time_t cur = clock_cache::now();
     timer->expire = cur + 3 * TIMESLOT;
     // 让用户数据中的定时器指针指向创建的定时器
     users_timer[connfd].timer = timer;
@@ -221,11 +342,11 @@ void WebServer::timer(int connfd, struct sockaddr_in client_address)
 // 该连接有数据接收或发送，说明是活跃的，调整它对应的定时器的超时时间
 void WebServer::adjust_timer(util_timer *timer)
 {
-    time_t cur = time(nullptr);
+    time_t cur = clock_cache::now();
     timer->expire = cur + 3 * TIMESLOT;
     utils.m_timer_lst.adjust_timer(timer);
 
-    LOG_INFO("%s", "adjust timer once");
+    LOG_DEBUG("%s", "adjust timer once");
 }
 
 // 处理异常事件，从sock缓冲区中读写失败或超时或客户端发生异常调用这个关闭连接
@@ -239,7 +360,7 @@ void WebServer::deal_timer(util_timer *timer, int sockfd)
         utils.m_timer_lst.del_timer(timer);
     }
 
-    LOG_INFO("close fd %d", users_timer[sockfd].sockfd);
+    LOG_DEBUG("close fd %d", users_timer[sockfd].sockfd);
 }
 
 // 处理客户连接
@@ -340,6 +461,20 @@ bool WebServer::dealwithsignal(bool &timeout, bool &stop_server)
                 stop_server = true;
                 break;
             }
+            case SIGUSR1:
+            case SIGUSR2:
+            {
+                int level = Log::set_level(Log::level() + (signals[i] == SIGUSR1 ? -1 : 1));
+                // 任何级别下都能看到这条记录
+                LOG_NOTICE("log level set to %d", level);
+                break;
+            }
+            case SIGHUP:
+            {
+                int rules = trace_filter::GetInstance()->load(TRACE_CONF_FILE);
+                LOG_NOTICE("reload %s: %d trace rules", TRACE_CONF_FILE, rules);
+                break;
+            }
             }
         }
     }
@@ -381,7 +516,7 @@ void WebServer::dealwithread(int sockfd)
     {
         if (users[sockfd].read_once()) // 读成功
         {
-            LOG_INFO("deal withthe client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
+            LOG_DEBUG("deal withthe client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
 
             // 读完将客户请求放入请求队列等待工作线程处理
             m_pool->append_p(users + sockfd);
@@ -433,7 +568,7 @@ void WebServer::dealwithwrite(int sockfd)
         // proactor主线程负责写
         if (users[sockfd].write())
         {
-            LOG_INFO("send data to the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
+            LOG_DEBUG("send data to the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
 
             if (timer)
             {
@@ -460,6 +595,8 @@ void WebServer::eventLoop()
         // 主线程调用epoll_wait在一段超时时间内等待一组文件描述符上的事件，并将当前所有就绪的epoll_event复制到events数组中
         // 最后一个参数是超时时间，设置为-1则一直阻塞直到有事件发生，等于0则立即返回
         int number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
+        // 每轮更新一次缓存的时钟，这一轮里的定时器、日志和响应头都读它
+        clock_cache::update();
         // EINTR错误是由于在任何请求的事件发生或超时到期之前，信号处理程序中断了该应用，如果不是这种错误，则终止循环
         if (number < 0 && errno != EINTR)
         {
@@ -479,6 +616,11 @@ void WebServer::eventLoop()
                 if (flag == false)
                     continue;
             }
+            // 异步数据库查询所用的socket就绪，继续执行查询，完成后生成响应
+            else if (http_conn::sql_waiting(sockfd))
+            {
+                http_conn::sql_event(sockfd, events[i].events);
+            }
             // 客户链接发生异常，关闭连接，移除注册再内核事件表中的事件，删除该定时器
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
@@ -507,11 +649,54 @@ void WebServer::eventLoop()
             {
                 // 遍历处理超时定时器，有超时的就关闭连接，删除定时器，处理完重设一个alarm延时信号
                 utils.timer_handler();
+                session_cache::GetInstance()->expire();
+                // 同步写日志时只有写日志的线程会检查刷盘间隔，空闲时由定时器检查
+                Log::get_instance()->flush_idle();
 
-                LOG_INFO("%s", "timer tick");
+                LOG_DEBUG("%s", "timer tick");
+                dump_stats();
 
                 timeout = false;
             }
         }
     }
-}
\ No newline at end of file
+}
+// 每次定时器到期时把各模块的统计写进日志
+void WebServer::dump_stats()
+{
+    user_cache *cache = user_cache::GetInstance();
+    LOG_INFO("user cache: %zu entries, %lld hits, %lld misses", cache->size(), cache->hits(), cache->misses());
+    user_flight *flight = user_flight::GetInstance();
+    LOG_INFO("user lookups: %lld queries, %lld coalesced", flight->leaders(), flight->followers());
+    session_cache *session = session_cache::GetInstance();
+    LOG_INFO("sessions: %zu active, %lld hits, %lld misses", session->size(), session->hits(), session->misses());
+
+    // 最长等待每个周期清零，反映最近一段时间的情况
+    sql_pool_stats sql;
+    if (m_connPool)
+    {
+        m_connPool->GetStats(sql, true);
+        LOG_INFO("sql pool: %d in use, %d idle, max %d, %lld acquires, avg wait %lldus, max wait %lldus, %lld timeouts, %lld reconnects",
+                 sql.in_use, sql.idle, sql.max, sql.acquires, sql.acquires ? sql.wait_us / sql.acquires : 0,
+                 sql.max_wait_us, sql.timeouts, sql.reconnects);
+    }
+
+    user_filter *filter = user_filter::GetInstance();
+    if (filter->enabled())
+    {
+        LOG_INFO("user filter: %zu names, %d layers, %zuKB, estimated fpr %.4f%%, %lld queries, %lld negatives, %lld false positives",
+                 filter->count(), filter->layers(), filter->memory() / 1024, filter->estimated_fpr() * 100,
+                 filter->queries(), filter->negatives(), filter->false_positives());
+    }
+
+    access_log *access = access_log::GetInstance();
+    if (access->enabled())
+        LOG_INFO("access log: %lld written, %lld dropped", access->written(), access->dropped());
+
+    if (m_log_write != 0)
+    {
+        Log *log = Log::get_instance();
+        LOG_INFO("log: dropped %lld debug, %lld info, %lld warn, %lld error lines",
+                 log->dropped(LOG_LEVEL_DEBUG), log->dropped(LOG_LEVEL_INFO), log->dropped(LOG_LEVEL_WARN), log->dropped(LOG_LEVEL_ERROR));
+    }
+}
@@ -14,10 +14,30 @@
 
 #include "./threadpool/threadpool.h"
 #include "./http/http_conn.h"
+#include "./CGImysql/register_batch.h"
+#include "./CGImysql/file_store.h"
+#include "./cache/user_snapshot.h"
+#include "./cache/user_filter.h"
 
 const int MAX_FD = 65536;           // 最大文件描述符（HTTP对象数）
 const int MAX_EVENT_NUMBER = 10000; // 最大事件数
 const int TIMESLOT = 5;             // 超时时间
+const int REGISTER_BATCH_WINDOW_US = 1000; // 注册组提交的攒批时间窗口
+const int SQL_ACQUIRE_TIMEOUT_MS = 500;    // 取数据库连接的最长等待时间，超时返回503
+const int USER_NEGATIVE_TTL = 60;          // 用户不存在的负缓存有效秒数
+const char USER_SNAPSHOT_FILE[] = "./user_cache.snap"; // 用户缓存快照文件
+const char USER_STORE_LOG_FILE[] = "./user_store.log";   // 嵌入式存储的日志文件
+const char USER_STORE_INDEX_FILE[] = "./user_store.idx"; // 嵌入式存储的索引文件
+const int USER_FILTER_CAPACITY = 1 << 20;  // 用户名布隆过滤器第一层容纳的用户数，超过后自动加层
+const double USER_FILTER_FPR = 0.01;       // 用户名布隆过滤器第一层的目标误判率
+const int SESSION_CAPACITY = 1 << 16;      // 最多保存的登录会话数，超过时淘汰最早的会话
+const int SESSION_TTL = 1800;              // 登录会话有效秒数
+const char ACCESS_LOG_FILE[] = "./access.log"; // 访问日志文件
+const int ACCESS_QUEUE_SIZE = 4096;        // 访问日志队列长度，满了丢弃新记录
+const int LOG_KEEP_FILES = 30;             // 最多保留的日志文件数（含压缩过的）
+const long long LOG_KEEP_BYTES = 1LL << 30; // 日志文件最多占用的磁盘空间
+const char TRACE_CONF_FILE[] = "./trace.conf"; // 跟踪规则文件，收到SIGHUP时重新加载
+const int USER_FLIGHT_TIMEOUT_MS = 1000;   // 等别的线程查同一用户名的最长时间，要盖住取连接和一次查询
 
 class WebServer
 {
@@ -26,8 +46,8 @@ public:
     ~WebServer();
 
     void init(int port, string user, string passWord, string databaseName,
-              int log_write, int opt_linger, int trigmode, int sql_num,
-              int thread_num, int close_log, int actor_model);
+              int log_write, int log_level, int log_overflow, int log_flush, string access_rates, int opt_linger, int trigmode, int sql_num, int sql_min,
+              int thread_num, int max_thread_num, int db_thread_num, int sql_async, int user_cache, int user_filter, int snapshot_interval, int sql_local, int user_store, int store_latency, int close_log, int actor_model);
     void thread_pool();
     void sql_pool();
     void log_write();
@@ -41,11 +61,16 @@ public:
     bool dealwithsignal(bool& timeout, bool& stop_server);
     void dealwithread(int sockfd);
     void dealwithwrite(int sockfd);
+    void dump_stats();
 
 public:
     int m_port;       // 端口号
     char *m_root;     // 存放资源的根目录
     int m_log_write;  // 异步还是同步写入日志
+    int m_log_level;  // 运行期日志级别
+    int m_log_overflow; // 异步日志暂存区满时的处理方式
+    int m_log_flush;    // 日志刷盘间隔（毫秒）
+    string m_access_rates; // 访问日志各状态码类别的采样百分比
     int m_close_log;  // 是否关闭日志
     int m_actormodel; // 并发模型选择（reactor/模拟proactor）
 
@@ -59,10 +84,22 @@ public:
     string m_passWord;           // 登陆密码
     string m_databaseName;       // 数据库名
     int m_sql_num;               // 数据库内连接数量
+    int m_sql_min;               // 启动时建立的数据库连接数
+    int m_sql_async;             // 是否异步执行数据库查询
+    int m_user_cache;            // 用户缓存容量，0表示全量加载
+    int m_user_filter;           // 是否开启用户名布隆过滤器
+    int m_snapshot_interval;     // 用户缓存快照的转储间隔
+    int m_sql_local;             // 工作线程是否独占数据库连接
+    user_store *m_store;         // 用户表存储
+    int m_store_type;            // 存储后端，0为MySQL，1为进程内存储，2为嵌入式文件存储
+    int m_store_latency;         // 进程内存储注入的延迟（微秒）
 
     // 线程池相关
     threadpool<http_conn> *m_pool; // 线程池
-    int m_thread_num;              // 线程数量
+    int m_thread_num;              // 线程数量（最小线程数）
+    int m_max_thread_num;          // 最大线程数
+    threadpool<http_conn> *m_db_pool; // 数据库线程池，专门处理登录、注册请求
+    int m_db_thread_num;              // 数据库线程池线程数量
 
     // epoll相关
     epoll_event events[MAX_EVENT_NUMBER]; // evetns数组